@@ -107,10 +107,30 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes (historical default; the heap now
+ * grows on demand up to MAX_RESERVE)
  */
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
 
+/*
+ * Size of the virtual address range reserved for the heap. The
+ * range is mapped PROT_NONE up front and pages are committed on
+ * demand as mem_brk advances, so untouched address space costs
+ * nothing at startup. Kept just under 4GB (2MB-aligned for the
+ * huge-page modes): heap offsets are full 32-bit values - see
+ * get_offset and run_map - so this is the widest reservation the
+ * offset encoding can address, and multi-GB trace replays fit.
+ */
+#define MAX_RESERVE (0xffffffffUL & ~((unsigned long)(1<<21) - 1))
+
+/*
+ * Default huge-page backing for the heap: 0 = plain 4KB pages,
+ * 1 = advise transparent huge pages, 2 = dedicated 2MB pages
+ * (MAP_HUGETLB). Overridable at runtime with the MEM_HUGEPAGES
+ * environment variable; failures fall back to 4KB pages.
+ */
+#define HEAP_HUGEPAGES 0
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -13,6 +13,39 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/*
+ * Hardware event counts from the perf_event engine. Cycles alone
+ * don't say why a change helped; these attribute it. valid is 0
+ * when the counters could not be opened (no perf_event support, or
+ * perf_event_paranoid forbids it) and every count is then 0.
+ */
+typedef struct {
+    double l1d_misses;     /* L1 data cache read misses */
+    double dtlb_misses;    /* data TLB read misses */
+    double branch_misses;  /* mispredicted branches */
+    int valid;
+} fcyc_events_t;
+
+/*
+ * fcyc_events_init - Open the hardware counters; call once before
+ *     timing, alongside the other set_fcyc_* configuration. Fails
+ *     silently (subsequent reads report valid == 0), so timing
+ *     still works where perf_event is unavailable.
+ */
+void fcyc_events_init(void);
+
+/*
+ * fcyc_get_events - Event deltas for the best-timed run of the most
+ *     recent fcyc() call.
+ */
+void fcyc_get_events(fcyc_events_t *out);
+
+/*
+ * fcyc_read_events - Current running counter totals, for callers
+ *     that bracket individual operations themselves.
+ */
+void fcyc_read_events(fcyc_events_t *out);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
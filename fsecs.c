@@ -29,6 +29,7 @@ void init_fsecs(void)
     set_fcyc_compensate(1);
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
+    fcyc_events_init();
     Mhz = mhz(verbose > 0);
 #elif USE_ITIMER
     if (verbose)
@@ -7,15 +7,23 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <search.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -23,6 +31,8 @@
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 
 /**********************
@@ -58,10 +68,25 @@
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *next;  /* next element in its hash bucket */
     int index;             /* same index as free; for debugging */
 } range_t;
 
+/*
+ * The set of live payload extents, indexed two ways: a chained hash
+ * keyed on the payload's low address gives O(1) insert and remove,
+ * and a balanced tree (tsearch) ordered by address answers overlap
+ * queries in O(log n). The old single linked list made add_range and
+ * remove_range O(live blocks) apiece, which dominated eval_mm_valid
+ * on traces with large live sets.
+ */
+typedef struct {
+    range_t **buckets;     /* hash buckets, chained through next */
+    size_t nbuckets;       /* bucket count; always a power of two */
+    size_t count;          /* number of live ranges */
+    void *tree;            /* tsearch root, ordered by address */
+} rangeset_t;
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
     enum { ALLOC, FREE, REALLOC } type; /* type of request */
@@ -69,6 +94,24 @@ typedef struct {
     size_t size;                      /* byte size of alloc/realloc request */
 } traceop_t;
 
+/*
+ * On-disk header of a binary trace (produced by -b). The header is
+ * followed by num_ops raw traceop_t records in the host's native
+ * layout, so read_trace can map the file and replay straight out of
+ * the mapping. The format is a cache for the text traces, not an
+ * interchange format: regenerate it after switching compilers or
+ * architectures.
+ */
+#define BINTRACE_MAGIC 0x70657262U /* "brep" */
+
+typedef struct {
+    unsigned int magic;  /* BINTRACE_MAGIC */
+    int weight;          /* same four fields as the text header */
+    int num_ids;
+    int num_ops;
+    int ignore_ranges;
+} bintrace_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     char filename[MAXLINE];
@@ -80,6 +123,8 @@ typedef struct {
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
     int *block_rand_base;/* index into random_data, if debug is on */
+    void *map;           /* mmap'd binary trace backing ops, or NULL */
+    size_t map_len;      /* length of that mapping */
 } trace_t;
 
 /*
@@ -89,7 +134,7 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;
-    range_t *ranges;
+    rangeset_t *ranges;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -106,6 +151,12 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* per-op latency percentiles in cycles, only defined with -L */
+    double lat_p50, lat_p95, lat_p99, lat_p999;
+
+    /* hardware events from the best timed run, when perf is usable */
+    fcyc_events_t events;
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -133,6 +184,7 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
+static int latency_flag = 0; /* -L: per-op latency histograms */
 
 /* by default, no timeouts */
 static int set_timeout = 0;
@@ -153,10 +205,10 @@ char autoresult[MAXLINE]; /* autoresult string */
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(rangeset_t *ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(rangeset_t *ranges, char *lo);
+static void clear_ranges(rangeset_t *ranges);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -166,6 +218,7 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void convert_trace(const char *tracedir, const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -175,9 +228,13 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, rangeset_t *ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void print_latency_summary(void);
+static void run_mt_bench(int maxthreads, const char *tracedir,
+                         char **tracefiles);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -202,7 +259,7 @@ static void timeout_handler(int sig __attribute__((unused))) {
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, const char *tracedir,
                       char **tracefiles,
-                      stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
+                      stats_t *mm_stats, rangeset_t *ranges, speed_t *speed_params) {
     volatile int i;
     volatile int timed_out = 0;
 
@@ -225,7 +282,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         } else {
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+            mm_stats[i].valid = eval_mm_valid(trace, ranges);
 
             if (onetime_flag) {
                 free_trace(trace);
@@ -241,6 +298,9 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            fcyc_get_events(&mm_stats[i].events);
+            if (latency_flag)
+                eval_mm_latency(trace, &mm_stats[i]);
         }
 
         free_trace(trace);
@@ -250,6 +310,113 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * Parallel variant of run_tests (-p). Every trace starts from its
+ * own mem_init and carries independent stats, so the untimed
+ * validity and utilization phases fork one worker process per trace
+ * - processes rather than threads, to keep the single-heap memlib
+ * model intact - and stream the finished stats_t back over a pipe.
+ * Only the timed eval_mm_speed phase runs serially afterwards, in
+ * this process and pinned to one core, so the measurements look the
+ * same as in a sequential run.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               rangeset_t *ranges, speed_t *speed_params) {
+    int i;
+    int *fds = malloc(num_tracefiles * sizeof(int));
+    pid_t *pids = malloc(num_tracefiles * sizeof(pid_t));
+    if (fds == NULL || pids == NULL)
+        unix_error("malloc failed in run_tests_parallel");
+
+    /* Phase 1: fork the validity/utilization workers */
+    for (i = 0; i < num_tracefiles; i++) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0)
+            unix_error("pipe failed in run_tests_parallel");
+        pids[i] = fork();
+        if (pids[i] < 0)
+            unix_error("fork failed in run_tests_parallel");
+
+        if (pids[i] == 0) {
+            close(pipefd[0]);
+            /* A stuck worker just dies; the parent scores it invalid */
+            if (set_timeout > 0) {
+                signal(SIGALRM, SIG_DFL);
+                alarm(set_timeout);
+            }
+
+            mem_init();
+            trace_t *trace = read_trace(&mm_stats[i], tracedir,
+                                        tracefiles[i]);
+            strcpy(mm_stats[i].filename, trace->filename);
+            mm_stats[i].ops = trace->num_ops;
+            mm_stats[i].valid = eval_mm_valid(trace, ranges);
+            if (mm_stats[i].valid)
+                mm_stats[i].util = eval_mm_util(trace, i);
+
+            if (write(pipefd[1], &mm_stats[i], sizeof(stats_t))
+                    != sizeof(stats_t))
+                _exit(1);
+            _exit(0);
+        }
+        close(pipefd[1]);
+        fds[i] = pipefd[0];
+    }
+
+    /* Collect the results; a worker that died scores as invalid */
+    for (i = 0; i < num_tracefiles; i++) {
+        size_t got = 0;
+        while (got < sizeof(stats_t)) {
+            ssize_t r = read(fds[i], (char *)&mm_stats[i] + got,
+                             sizeof(stats_t) - got);
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        close(fds[i]);
+
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (got != sizeof(stats_t) ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("Worker for trace %s%s failed\n", tracedir,
+                   tracefiles[i]);
+            strcpy(mm_stats[i].filename, tracefiles[i]);
+            mm_stats[i].valid = 0;
+            errors = 1;
+        }
+    }
+    free(fds);
+    free(pids);
+
+    /* Phase 2: the timed runs, serialized and pinned to one core */
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0 && verbose > 0)
+        printf("Could not pin the timing runs to a core\n");
+
+    for (i = 0; i < num_tracefiles; i++) {
+        if (!mm_stats[i].valid)
+            continue;
+
+        mem_init();
+        stats_t scratch;
+        trace_t *trace = read_trace(&scratch, tracedir, tracefiles[i]);
+        speed_params->trace = trace;
+        speed_params->ranges = ranges;
+        if (verbose > 1)
+            printf("Timing %s.\n", trace->filename);
+        mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+        fcyc_get_events(&mm_stats[i].events);
+        if (latency_flag)
+            eval_mm_latency(trace, &mm_stats[i]);
+        free_trace(trace);
+        mem_deinit();
+    }
+}
+
 /**************
  * Main routine
  **************/
@@ -260,13 +427,16 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
 
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    rangeset_t ranges = { NULL, 0, 0, NULL }; /* block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
     int autograder = 0;   /* if set then called by autograder (-A) */
+    int convert_flag = 0; /* if set, convert traces to binary (-b) */
+    int parallel_flag = 0;/* if set, run the traces in parallel (-p) */
+    int mt_threads = 0;   /* if set, run the MT benchmark on N threads (-m) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -280,13 +450,31 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "bd:f:c:s:t:v:hpLm:VAlD")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
             autograder = 1;
             break;
 
+        case 'b': /* Convert the selected traces to binary and exit */
+            convert_flag = 1;
+            break;
+
+        case 'p': /* Evaluate traces in parallel worker processes */
+            parallel_flag = 1;
+            break;
+
+        case 'L': /* Collect per-op latency histograms */
+            latency_flag = 1;
+            break;
+
+        case 'm': /* Run the multithreaded benchmark on N threads */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1)
+                mt_threads = 1;
+            break;
+
         case 'f': /* Use one specific trace file only (relative to curr dir) */
             num_tracefiles = 1;
             if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
@@ -354,6 +542,12 @@ int main(int argc, char **argv)
         printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    if (convert_flag) {
+        for (i = 0; i < num_tracefiles; i++)
+            convert_trace(tracedir, tracefiles[i]);
+        exit(0);
+    }
+
     if(debug_mode != DBG_NONE) {
         init_random_data();
     }
@@ -361,6 +555,12 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* The multithreaded benchmark replaces the trace evaluation */
+    if (mt_threads > 0) {
+        run_mt_bench(mt_threads, tracedir, tracefiles);
+        exit(0);
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -413,8 +613,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-              ranges, &speed_params);
+    if (parallel_flag && !onetime_flag)
+        run_tests_parallel(num_tracefiles, tracedir, tracefiles, mm_stats,
+                           &ranges, &speed_params);
+    else
+        run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                  &ranges, &speed_params);
 
 
     /* Display the mm results in a compact table */
@@ -429,6 +633,8 @@ int main(int argc, char **argv)
         } else {
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats);
+            if (latency_flag)
+                print_latency_summary();
             printf("\n");
         }
     }
@@ -551,13 +757,59 @@ int main(int argc, char **argv)
  * range list to detect any overlapping allocated blocks.
  ****************************************************************/
 
+/* Hash a payload address into a bucket index */
+static size_t range_hash(const rangeset_t *ranges, const char *lo)
+{
+    return (((uintptr_t)lo >> 4) * 2654435761UL) & (ranges->nbuckets - 1);
+}
+
+/*
+ * range_cmp - Orders disjoint ranges by address, with any overlap
+ *     comparing equal. Stored ranges never overlap, so this is a
+ *     consistent ordering for the tree, and inserting a new range
+ *     with tsearch doubles as the overlap query: an occupant coming
+ *     back instead of the new node is the overlapping block.
+ */
+static int range_cmp(const void *x, const void *y)
+{
+    const range_t *a = x;
+    const range_t *b = y;
+    if (a->hi < b->lo) return -1;
+    if (a->lo > b->hi) return 1;
+    return 0;
+}
+
+/* Double the bucket array (or create it) and rehash */
+static void grow_buckets(rangeset_t *ranges)
+{
+    size_t oldn = ranges->nbuckets;
+    range_t **oldb = ranges->buckets;
+
+    ranges->nbuckets = oldn ? 2 * oldn : 1024;
+    ranges->buckets = calloc(ranges->nbuckets, sizeof(range_t *));
+    if (ranges->buckets == NULL)
+        unix_error("calloc error in grow_buckets");
+
+    for (size_t b = 0; b < oldn; b++) {
+        range_t *p = oldb[b];
+        while (p != NULL) {
+            range_t *next = p->next;
+            size_t nb = range_hash(ranges, p->lo);
+            p->next = ranges->buckets[nb];
+            ranges->buckets[nb] = p;
+            p = next;
+        }
+    }
+    free(oldb);
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range set.
  */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(rangeset_t *ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
 {
     char *hi = lo + size - 1;
@@ -572,42 +824,47 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or entirely
+       outside of it (huge blocks are served from their own mmap
+       regions); straddling the heap boundary is always a bug */
+    if (!((lo >= (char *)mem_heap_lo()) && (hi <= (char *)mem_heap_hi())) &&
+        !((hi < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()))) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) lies outside heap (%p:%p)",
+                     "Payload (%p:%p) straddles heap boundary (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
+    /* Traces that are too big to track opt out; the overlap would
+       still be caught by writing random bits. */
     if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
 
-
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            malloc_error(trace, opnum,
-                         "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                         lo, hi, p->lo, p->hi);
-            return 0;
-        }
-    }
-
-    /*
-     * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
-     */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
     p->index = index;
-    *ranges = p;
+
+    /* Insert into the address-ordered tree; finding an occupant
+       there means the new payload overlaps it */
+    range_t **node = (range_t **)tsearch(p, &ranges->tree, range_cmp);
+    if (node == NULL)
+        unix_error("tsearch error in add_range");
+    if (*node != p) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                     lo, hi, (*node)->lo, (*node)->hi);
+        free(p);
+        return 0;
+    }
+
+    /* And into the hash keyed on the payload address */
+    if (ranges->count >= 2 * ranges->nbuckets)
+        grow_buckets(ranges);
+    size_t b = range_hash(ranges, lo);
+    p->next = ranges->buckets[b];
+    ranges->buckets[b] = p;
+    ranges->count++;
 
     return 1;
 }
@@ -615,15 +872,18 @@ static int add_range(range_t **ranges, char *lo, int size,
 /*
  * remove_range - Free the range record of block whose payload starts at lo
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(rangeset_t *ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    if (ranges->nbuckets == 0)
+        return;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
+    range_t **prevpp = &ranges->buckets[range_hash(ranges, lo)];
+    for (range_t *p = *prevpp; p != NULL; p = p->next) {
         if (p->lo == lo) {
             *prevpp = p->next;
+            tdelete(p, &ranges->tree, range_cmp);
             free(p);
+            ranges->count--;
             break;
         }
         prevpp = &(p->next);
@@ -631,18 +891,22 @@ static void remove_range(range_t **ranges, char *lo)
 }
 
 /*
- * clear_ranges - free all of the range records for a trace
+ * clear_ranges - free all of the range records for a trace. The
+ *     bucket array itself is kept for the next trace.
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(rangeset_t *ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    for (size_t b = 0; b < ranges->nbuckets; b++) {
+        range_t *pnext;
+        for (range_t *p = ranges->buckets[b]; p != NULL; p = pnext) {
+            pnext = p->next;
+            tdelete(p, &ranges->tree, range_cmp);
+            free(p);
+        }
+        ranges->buckets[b] = NULL;
     }
-    *ranges = NULL;
+    ranges->count = 0;
+    assert(ranges->tree == NULL);
 }
 
 /**********************************************
@@ -737,10 +1001,47 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    fscanf(tracefile, "%d", &trace->weight);
-    fscanf(tracefile, "%d", &trace->num_ids);
-    fscanf(tracefile, "%d", &trace->num_ops);
-    fscanf(tracefile, "%d", &trace->ignore_ranges);
+
+    trace->map = NULL;
+    trace->map_len = 0;
+
+    /* A binary trace announces itself with a magic number */
+    unsigned int magic = 0;
+    if (fread(&magic, sizeof(magic), 1, tracefile) != 1)
+        app_error("%s: empty trace file", trace->filename);
+    rewind(tracefile);
+
+    if (magic == BINTRACE_MAGIC) {
+        /* Map the file and replay the ops straight out of the mapping */
+        struct stat st;
+        if (fstat(fileno(tracefile), &st) < 0)
+            unix_error("fstat failed in read_trace");
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                         fileno(tracefile), 0);
+        if (map == MAP_FAILED)
+            unix_error("mmap failed in read_trace");
+        fclose(tracefile);
+        tracefile = NULL;
+
+        bintrace_t *hdr = (bintrace_t *)map;
+        trace->weight = hdr->weight;
+        trace->num_ids = hdr->num_ids;
+        trace->num_ops = hdr->num_ops;
+        trace->ignore_ranges = hdr->ignore_ranges;
+        if ((size_t)st.st_size !=
+            sizeof(*hdr) + trace->num_ops * sizeof(traceop_t))
+            app_error("%s: truncated binary trace", trace->filename);
+
+        trace->map = map;
+        trace->map_len = st.st_size;
+        trace->ops = (traceop_t *)(hdr + 1);
+    }
+    else {
+        fscanf(tracefile, "%d", &trace->weight);
+        fscanf(tracefile, "%d", &trace->num_ids);
+        fscanf(tracefile, "%d", &trace->num_ops);
+        fscanf(tracefile, "%d", &trace->ignore_ranges);
+    }
 
     if(trace->weight < 0 || trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
@@ -749,8 +1050,10 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         app_error("%s: ignore-ranges can only be zero or one", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
+    /* We'll store each request line in the trace in this array
+       (a mapped binary trace already has them in place) */
+    if (trace->map == NULL &&
+        (trace->ops =
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
@@ -773,7 +1076,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
+    while (tracefile != NULL && fscanf(tracefile, "%s", type) != EOF) {
         switch(type[0]) {
         case 'a':
             fscanf(tracefile, "%d %d", &index, &size);
@@ -801,9 +1104,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         op_index++;
         if(op_index == trace->num_ops) break;
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    if (tracefile != NULL) {
+        fclose(tracefile);
+        assert(max_index == trace->num_ids - 1);
+        assert(trace->num_ops == op_index);
+    }
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -813,6 +1118,34 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * convert_trace - parse a text trace and write it back out in the
+ *                 binary format, next to the original as <name>.bin
+ */
+static void convert_trace(const char *tracedir, const char *filename)
+{
+    stats_t stats;
+    trace_t *trace = read_trace(&stats, tracedir, filename);
+    char outname[MAXLINE + 8];
+    sprintf(outname, "%s.bin", trace->filename);
+
+    FILE *out = fopen(outname, "w");
+    if (out == NULL)
+        unix_error("Could not open %s in convert_trace", outname);
+
+    bintrace_t hdr = { BINTRACE_MAGIC, trace->weight, trace->num_ids,
+                       trace->num_ops, trace->ignore_ranges };
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out)
+            != (size_t)trace->num_ops)
+        unix_error("write failed in convert_trace");
+    fclose(out);
+
+    printf("Converted %s (%d ops) to %s\n", trace->filename,
+           trace->num_ops, outname);
+    free_trace(trace);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -829,7 +1162,10 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* ops live in the trace mapping... */
+        munmap(trace->map, trace->map_len);
+    else
+        free(trace->ops);     /* ...or in their own array */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
@@ -844,7 +1180,7 @@ static void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, rangeset_t *ranges)
 {
     int i;
     int index;
@@ -876,10 +1212,9 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             mm_checkheap(verbose);
 
             /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
+            for (size_t b = 0; b < ranges->nbuckets; b++) {
+                for (r = ranges->buckets[b]; r != NULL; r = r->next)
+                    check_index(trace, i, r->index);
             }
         }
 
@@ -991,6 +1326,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t peak_mmap = 0, cur_mmap;
+    mm_stats_t snap;
     char *p;
     char *newp, *oldp;
 
@@ -1061,11 +1398,19 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        /* Huge payloads are served from mmap regions outside the
+           sbrk heap; track their high-water mark too, so they count
+           in the denominator as well as the numerator. */
+        mm_get_stats(&snap);
+        cur_mmap = snap.heap_bytes - mem_heapsize();
+        peak_mmap = (cur_mmap > peak_mmap) ? cur_mmap : peak_mmap;
     }
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size /
+            (double)(mem_heapsize() + peak_mmap));
 }
 
 
@@ -1121,6 +1466,455 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*****************************************************************
+ * Per-operation latency histograms (-L)
+ *
+ * fsecs() times a whole replay, which hides exactly what hurts:
+ * the occasional free that walks a long bin or a malloc that
+ * grows the heap vanishes into the average. Latency mode replays
+ * each trace once more with every mm_malloc/mm_free/mm_realloc
+ * wrapped in the cycle counter from clock.h, bucketing the cycle
+ * counts into log2-scaled histograms per op type and request
+ * size class. The instrumented replay is separate from the fsecs
+ * run so the reported throughput stays unperturbed.
+ *****************************************************************/
+
+#define LAT_NBUCKETS 40  /* bucket k holds cycle counts in [2^k, 2^(k+1)) */
+#define LAT_NCLASSES 4
+
+enum { LAT_MALLOC, LAT_FREE, LAT_REALLOC, LAT_NTYPES };
+
+static const char *lat_type_name[LAT_NTYPES] =
+    { "malloc", "free", "realloc" };
+static const char *lat_class_name[LAT_NCLASSES] =
+    { "<=64", "<=1K", "<=64K", ">64K" };
+
+/* counts aggregated over every trace, for the summary table */
+static unsigned long lat_hist[LAT_NTYPES][LAT_NCLASSES][LAT_NBUCKETS];
+
+/* hardware event totals (L1D, dTLB, branch misses) per cell, when
+   the perf counters in fcyc are usable */
+static double lat_events[LAT_NTYPES][LAT_NCLASSES][3];
+static int lat_events_on;
+
+static int lat_class(size_t size)
+{
+    if (size <= 64)
+        return 0;
+    if (size <= 1024)
+        return 1;
+    if (size <= 65536)
+        return 2;
+    return 3;
+}
+
+static int lat_bucket(double cycles)
+{
+    int k = 0;
+    while (cycles >= 2.0 && k < LAT_NBUCKETS - 1) {
+        cycles /= 2.0;
+        k++;
+    }
+    return k;
+}
+
+/*
+ * lat_percentile - read the frac'th percentile out of a histogram.
+ *    Returns the midpoint of the first bucket whose cumulative
+ *    count reaches frac, so the answer is exact to within one
+ *    power of two.
+ */
+static double lat_percentile(const unsigned long *hist, double frac)
+{
+    unsigned long total = 0, seen = 0;
+    int k;
+
+    for (k = 0; k < LAT_NBUCKETS; k++)
+        total += hist[k];
+    if (total == 0)
+        return 0;
+
+    for (k = 0; k < LAT_NBUCKETS; k++) {
+        seen += hist[k];
+        if ((double)seen >= frac * (double)total)
+            return 1.5 * (double)(1UL << k);
+    }
+    return 1.5 * (double)(1UL << (LAT_NBUCKETS - 1));
+}
+
+static void lat_record(int type, size_t size, double cycles,
+                       unsigned long *trace_hist,
+                       const fcyc_events_t *e0, const fcyc_events_t *e1)
+{
+    int c = lat_class(size);
+    lat_hist[type][c][lat_bucket(cycles)]++;
+    trace_hist[lat_bucket(cycles)]++;
+    if (lat_events_on) {
+        lat_events[type][c][0] += e1->l1d_misses - e0->l1d_misses;
+        lat_events[type][c][1] += e1->dtlb_misses - e0->dtlb_misses;
+        lat_events[type][c][2] += e1->branch_misses - e0->branch_misses;
+    }
+}
+
+/*
+ * eval_mm_latency - replay a trace with each op individually timed,
+ *    filling the global per-type/per-class histograms and the
+ *    trace's own percentile summary in stats.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    unsigned long trace_hist[LAT_NBUCKETS] = {0};
+    double cycles;
+    fcyc_events_t e0, e1;
+    reinit_trace(trace);
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    fcyc_read_events(&e0);
+    lat_events_on = e0.valid;
+
+    for (i = 0;  i < trace->num_ops;  i++)
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (lat_events_on)
+                fcyc_read_events(&e0);
+            start_counter();
+            p = mm_malloc(size);
+            cycles = get_counter();
+            if (lat_events_on)
+                fcyc_read_events(&e1);
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            lat_record(LAT_MALLOC, size, cycles, trace_hist, &e0, &e1);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+            oldp = trace->blocks[index];
+            if (lat_events_on)
+                fcyc_read_events(&e0);
+            start_counter();
+            newp = mm_realloc(oldp, newsize);
+            cycles = get_counter();
+            if (lat_events_on)
+                fcyc_read_events(&e1);
+            if (newp == NULL && newsize != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            lat_record(LAT_REALLOC, newsize, cycles, trace_hist, &e0, &e1);
+            trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
+            break;
+
+        case FREE: /* mm_free */
+            index = trace->ops[i].index;
+            if(index < 0) {
+                block = 0;
+                size = 0;
+            } else {
+                block = trace->blocks[index];
+                size = trace->block_sizes[index];
+            }
+            if (lat_events_on)
+                fcyc_read_events(&e0);
+            start_counter();
+            mm_free(block);
+            cycles = get_counter();
+            if (lat_events_on)
+                fcyc_read_events(&e1);
+            lat_record(LAT_FREE, size, cycles, trace_hist, &e0, &e1);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+
+    stats->lat_p50  = lat_percentile(trace_hist, 0.50);
+    stats->lat_p95  = lat_percentile(trace_hist, 0.95);
+    stats->lat_p99  = lat_percentile(trace_hist, 0.99);
+    stats->lat_p999 = lat_percentile(trace_hist, 0.999);
+}
+
+/*
+ * print_latency_summary - the per-type/per-class tail, aggregated
+ *    over every timed trace. Rows with no samples are skipped.
+ */
+static void print_latency_summary(void)
+{
+    int t, c, k;
+
+    printf("\nPer-op latency (cycles):\n");
+    printf("%8s %6s%10s%8s%8s%8s%9s",
+           "op", "size", "count", "p50", "p95", "p99", "p99.9");
+    if (lat_events_on)
+        printf("%8s%9s%8s", "L1m/op", "dTLB/op", "brm/op");
+    printf("\n");
+    for (t = 0; t < LAT_NTYPES; t++) {
+        for (c = 0; c < LAT_NCLASSES; c++) {
+            unsigned long count = 0;
+            for (k = 0; k < LAT_NBUCKETS; k++)
+                count += lat_hist[t][c][k];
+            if (count == 0)
+                continue;
+            printf("%8s %6s%10lu%8.0f%8.0f%8.0f%9.0f",
+                   lat_type_name[t], lat_class_name[c], count,
+                   lat_percentile(lat_hist[t][c], 0.50),
+                   lat_percentile(lat_hist[t][c], 0.95),
+                   lat_percentile(lat_hist[t][c], 0.99),
+                   lat_percentile(lat_hist[t][c], 0.999));
+            if (lat_events_on)
+                printf("%8.2f%9.2f%8.2f",
+                       lat_events[t][c][0] / count,
+                       lat_events[t][c][1] / count,
+                       lat_events[t][c][2] / count);
+            printf("\n");
+        }
+    }
+}
+
+/*****************************************************************
+ * Multithreaded benchmark mode (-m N)
+ *
+ * The trace runs above are all single-threaded, so they cannot see
+ * contention on the arena locks or the cost of cross-thread frees.
+ * This mode runs a synthetic load on 1..N threads, drawing request
+ * sizes from the first selected trace. Each thread spends half its
+ * ops churning a private working set; for the other half, threads
+ * are paired producer-consumer, with the even thread mallocing
+ * blocks that its odd partner frees - the pattern that stresses an
+ * arena design hardest. Each full run is timed with fsecs() like
+ * the trace replays, and the table reports aggregate and
+ * per-thread throughput plus scaling efficiency against the
+ * single-threaded run.
+ *****************************************************************/
+
+#define MT_MAXTHREADS 32
+#define MT_NOPS (1 << 17)   /* mallocs per run, split across threads */
+#define MT_WSET 64          /* private live blocks per thread */
+#define MT_RING 256         /* handoff slots per producer-consumer pair */
+
+/* One block-handoff ring per thread pair: the even thread mallocs
+   into it and the odd thread frees out of it. */
+typedef struct {
+    void *slots[MT_RING];
+    int head, tail;          /* head == tail means empty */
+    int done;                /* producer finished */
+    pthread_mutex_t lock;
+    pthread_cond_t notempty, notfull;
+} mt_ring_t;
+
+typedef struct {
+    int nthreads;
+    long mallocs;            /* malloc calls per thread, per run */
+    const int *sizes;        /* request size distribution */
+    int nsizes;
+    long ops_done[MT_MAXTHREADS]; /* mallocs+frees, from the last run */
+    mt_ring_t rings[(MT_MAXTHREADS + 1) / 2];
+} mt_param_t;
+
+typedef struct {
+    mt_param_t *mp;
+    int id;
+} mt_arg_t;
+
+static void *mt_worker(void *argp)
+{
+    mt_arg_t *arg = (mt_arg_t *)argp;
+    mt_param_t *mp = arg->mp;
+    int id = arg->id;
+    mt_ring_t *ring = &mp->rings[id / 2];
+    long priv = mp->mallocs / 2;
+    long hand = mp->mallocs - priv;
+    long ops = 0;
+    long j;
+    void *wset[MT_WSET] = {0};
+    void *p;
+    int k;
+
+    /* Phase 1: thread-private churn over a small working set */
+    for (j = 0; j < priv; j++) {
+        k = j % MT_WSET;
+        if (wset[k] != NULL) {
+            mm_free(wset[k]);
+            ops++;
+        }
+        if ((wset[k] = mm_malloc(mp->sizes[(id * 7 + j) % mp->nsizes]))
+                == NULL)
+            app_error("mm_malloc error in mt_worker");
+        ops++;
+    }
+    for (k = 0; k < MT_WSET; k++)
+        if (wset[k] != NULL) {
+            mm_free(wset[k]);
+            ops++;
+        }
+
+    /* Phase 2: producer-consumer across the pair (id, id^1). The
+       last thread of an odd-sized team has no partner and keeps
+       churning on its own. */
+    if ((id | 1) >= mp->nthreads) {
+        for (j = 0; j < hand; j++) {
+            if ((p = mm_malloc(mp->sizes[(id + j) % mp->nsizes])) == NULL)
+                app_error("mm_malloc error in mt_worker");
+            mm_free(p);
+            ops += 2;
+        }
+    } else if ((id & 1) == 0) {
+        /* producer: malloc here, the partner frees */
+        for (j = 0; j < hand; j++) {
+            if ((p = mm_malloc(mp->sizes[(id + j) % mp->nsizes])) == NULL)
+                app_error("mm_malloc error in mt_worker");
+            ops++;
+            pthread_mutex_lock(&ring->lock);
+            while ((ring->head + 1) % MT_RING == ring->tail)
+                pthread_cond_wait(&ring->notfull, &ring->lock);
+            ring->slots[ring->head] = p;
+            ring->head = (ring->head + 1) % MT_RING;
+            pthread_cond_signal(&ring->notempty);
+            pthread_mutex_unlock(&ring->lock);
+        }
+        pthread_mutex_lock(&ring->lock);
+        ring->done = 1;
+        pthread_cond_signal(&ring->notempty);
+        pthread_mutex_unlock(&ring->lock);
+    } else {
+        /* consumer: free blocks malloc'd on the partner thread */
+        for (;;) {
+            pthread_mutex_lock(&ring->lock);
+            while (ring->tail == ring->head && !ring->done)
+                pthread_cond_wait(&ring->notempty, &ring->lock);
+            if (ring->tail == ring->head) {
+                pthread_mutex_unlock(&ring->lock);
+                break;
+            }
+            p = ring->slots[ring->tail];
+            ring->tail = (ring->tail + 1) % MT_RING;
+            pthread_cond_signal(&ring->notfull);
+            pthread_mutex_unlock(&ring->lock);
+            mm_free(p);
+            ops++;
+        }
+    }
+
+    mp->ops_done[id] = ops;
+    return NULL;
+}
+
+/*
+ * eval_mm_mt - one full multithreaded run, shaped for fsecs()
+ *    like eval_mm_speed: reset the heap, spawn the team, join.
+ */
+static void eval_mm_mt(void *ptr)
+{
+    mt_param_t *mp = (mt_param_t *)ptr;
+    pthread_t tids[MT_MAXTHREADS];
+    mt_arg_t args[MT_MAXTHREADS];
+    int t;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_mt");
+
+    for (t = 0; t < (mp->nthreads + 1) / 2; t++) {
+        mt_ring_t *ring = &mp->rings[t];
+        ring->head = ring->tail = ring->done = 0;
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->notempty, NULL);
+        pthread_cond_init(&ring->notfull, NULL);
+    }
+
+    for (t = 0; t < mp->nthreads; t++) {
+        args[t].mp = mp;
+        args[t].id = t;
+        if (pthread_create(&tids[t], NULL, mt_worker, &args[t]) != 0)
+            app_error("pthread_create failed in eval_mm_mt");
+    }
+    for (t = 0; t < mp->nthreads; t++)
+        pthread_join(tids[t], NULL);
+
+    for (t = 0; t < (mp->nthreads + 1) / 2; t++) {
+        mt_ring_t *ring = &mp->rings[t];
+        pthread_mutex_destroy(&ring->lock);
+        pthread_cond_destroy(&ring->notempty);
+        pthread_cond_destroy(&ring->notfull);
+    }
+}
+
+/*
+ * run_mt_bench - the -m mode: time the synthetic load on 1, 2, 4,
+ *    ... up to maxthreads threads and print the scaling table.
+ */
+static void run_mt_bench(int maxthreads, const char *tracedir,
+                         char **tracefiles)
+{
+    static int sizes[4096];
+    int nsizes = 0;
+    stats_t scratch;
+    trace_t *trace;
+    mt_param_t mp;
+    double base_kops = 0;
+    int t, i;
+
+    if (maxthreads > MT_MAXTHREADS)
+        maxthreads = MT_MAXTHREADS;
+
+    /* Draw the request size distribution from the first trace */
+    trace = read_trace(&scratch, tracedir, tracefiles[0]);
+    for (i = 0; i < trace->num_ops && nsizes < 4096; i++)
+        if (trace->ops[i].type == ALLOC || trace->ops[i].type == REALLOC)
+            sizes[nsizes++] = trace->ops[i].size;
+    free_trace(trace);
+    if (nsizes == 0)
+        app_error("no allocation sizes found in %s", tracefiles[0]);
+
+    printf("\nMultithreaded benchmark: %d mallocs per run, sizes from %s\n",
+           MT_NOPS, tracefiles[0]);
+    printf("%8s%10s%10s%12s%12s\n",
+           "threads", "secs", "Kops/s", "per-thread", "efficiency");
+
+    t = 1;
+    for (;;) {
+        double secs, kops;
+        long total = 0;
+
+        memset(&mp, 0, sizeof(mp));
+        mp.nthreads = t;
+        mp.mallocs = MT_NOPS / t;
+        mp.sizes = sizes;
+        mp.nsizes = nsizes;
+
+        mem_init();
+        secs = fsecs(eval_mm_mt, &mp);
+        mem_deinit();
+
+        for (i = 0; i < t; i++)
+            total += mp.ops_done[i];
+        kops = (double)total / secs / 1e3;
+        if (t == 1)
+            base_kops = kops;
+        printf("%8d%10.6f%10.0f%12.0f%11.0f%%\n",
+               t, secs, kops, kops / t,
+               100.0 * kops / (base_kops * t));
+        if (verbose > 1)
+            for (i = 0; i < t; i++)
+                printf("    thread %2d: %6.0f Kops/s\n",
+                       i, (double)mp.ops_done[i] / secs / 1e3);
+
+        if (t >= maxthreads)
+            break;
+        t = (t * 2 < maxthreads) ? t * 2 : maxthreads;
+    }
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1238,9 +2032,25 @@ static void printresults(int n, stats_t *stats)
 
     char wstr;
 
+    /* Record how the heap was backed along with the results */
+    if (mem_hugepage_mode() != 0)
+        printf("Heap backing: %s huge pages\n",
+               mem_hugepage_mode() == 2 ? "dedicated 2MB" : "transparent");
+
+    /* The event columns appear only when the perf counters opened */
+    int have_events = 0;
+    for (i = 0; i < n; i++)
+        if (stats[i].valid && stats[i].events.valid)
+            have_events = 1;
+
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s",
+           "valid", "util", "ops", "secs", "Kops");
+    if (latency_flag)
+        printf("%8s%8s%8s%9s", "p50", "p95", "p99", "p99.9");
+    if (have_events)
+        printf("%8s%9s%8s", "L1m/op", "dTLB/op", "brm/op");
+    printf("  %s\n", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1282,6 +2092,28 @@ static void printresults(int n, stats_t *stats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* per-op percentiles in cycles, filled by eval_mm_latency */
+            if (latency_flag) {
+                if (stats[i].weight == WNONE || stats[i].weight == WALL
+                    || stats[i].weight == WPERF)
+                    printf("%8.0f%8.0f%8.0f%9.0f",
+                           stats[i].lat_p50, stats[i].lat_p95,
+                           stats[i].lat_p99, stats[i].lat_p999);
+                else
+                    printf("%8s%8s%8s%9s", "--", "--", "--", "--");
+            }
+
+            /* hardware events per op, from the best timed run */
+            if (have_events) {
+                if (stats[i].events.valid && stats[i].ops > 0)
+                    printf("%8.2f%9.2f%8.2f",
+                           stats[i].events.l1d_misses / stats[i].ops,
+                           stats[i].events.dtlb_misses / stats[i].ops,
+                           stats[i].events.branch_misses / stats[i].ops);
+                else
+                    printf("%8s%9s%8s", "--", "--", "--");
+            }
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1375,14 +2207,21 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-bhlVdD] [-f <file>]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Convert the selected traces to binary (<file>.bin) and exit.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Time every op with the cycle counter and report\n");
+    fprintf(stderr, "\t           latency percentiles (runs an extra replay).\n");
+    fprintf(stderr, "\t-m <n>     Run the multithreaded benchmark, scaling from\n");
+    fprintf(stderr, "\t           1 to n threads, instead of the traces.\n");
+    fprintf(stderr, "\t-p         Evaluate traces in parallel worker processes;\n");
+    fprintf(stderr, "\t           only the timed phase runs serially.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
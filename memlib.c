@@ -21,33 +21,86 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_committed;		/* pages below this are read/write */
+static int hugepage_mode;		/* 0 none, 1 transparent, 2 MAP_HUGETLB */
 
 /*
  * mem_init - initialize the memory system model
+ *
+ * The full MAX_RESERVE range is reserved up front as an
+ * inaccessible PROT_NONE mapping, keeping the heap contiguous (so
+ * the allocator's 32-bit offsets stay valid) without paying for
+ * address space that is never touched; mem_sbrk commits pages on
+ * demand as mem_brk advances.
+ *
+ * The heap can be backed by 2MB huge pages to cut dTLB pressure
+ * during header/footer walks: mode 2 asks for dedicated huge pages
+ * (MAP_HUGETLB, needs a configured hugetlb pool), mode 1 advises
+ * transparent huge pages on the region. The HEAP_HUGEPAGES config
+ * default can be overridden with the MEM_HUGEPAGES environment
+ * variable; a failed huge-page mapping falls back to 4KB pages.
  */
 void mem_init(void){
-	int dev_zero = open("/dev/zero", O_RDWR);
-	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
-			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
-			dev_zero,				/* fd */
-			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
+	char *opt = getenv("MEM_HUGEPAGES");
+	int want = (opt != NULL) ? atoi(opt) : HEAP_HUGEPAGES;
+
+	if(heap != NULL && heap != MAP_FAILED)
+		munmap(heap, MAX_RESERVE);	/* drop a previous run's heap */
+
+	heap = MAP_FAILED;
+	hugepage_mode = 0;
+
+	if(want == 2){
+		heap = mmap((void *)0x800000000,
+				MAX_RESERVE,
+				PROT_NONE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_HUGETLB,
+				-1,
+				0);
+		if(heap != MAP_FAILED)
+			hugepage_mode = 2;
+	}
+	if(heap == MAP_FAILED){
+		heap = mmap((void *)0x800000000, /* suggested start*/
+				MAX_RESERVE,			/* length */
+				PROT_NONE,				/* committed on demand */
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+				-1,
+				0);
+		if(want >= 1 && heap != MAP_FAILED &&
+				madvise(heap, MAX_RESERVE, MADV_HUGEPAGE) == 0)
+			hugepage_mode = 1;
+	}
+	mem_max_addr = heap + MAX_RESERVE;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_committed = heap;			/* nothing committed yet */
+}
+
+/*
+ * mem_hugepage_mode - report how the heap ended up backed, so the
+ *		driver can record it alongside results: 0 = 4KB pages,
+ *		1 = transparent huge pages advised, 2 = dedicated huge pages.
+ */
+int mem_hugepage_mode(void){
+	return hugepage_mode;
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+	munmap(heap, MAX_RESERVE);
+	heap = NULL;
 }
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk(){
+	/* Scrub the old contents so the next run sees the same all-zero
+	   memory a fresh sbrk would provide */
+	if (mem_brk > heap)
+		mem_release(heap, mem_brk - heap);
 	mem_brk = heap;
 }
 
@@ -67,10 +120,34 @@ void *mem_sbrk(int incr) {
 		return (void *)-1;
 	}
 
+	/* Commit reserved pages on demand as the brk advances */
+	if (mem_brk + incr > mem_committed) {
+		size_t pg = (hugepage_mode == 2) ? (size_t)(1<<21)
+		                                 : (size_t)getpagesize();
+		size_t need = (size_t)(mem_brk + incr - mem_committed);
+		need = (need + pg - 1) & ~(pg - 1);
+		if (mprotect(mem_committed, need, PROT_READ|PROT_WRITE) != 0) {
+			errno = ENOMEM;
+			fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+			return (void *)-1;
+		}
+		mem_committed += need;
+	}
+
 	mem_brk += incr;
 	return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the pages spanning [lo, lo+len) back to the OS
+ *		while keeping the address range valid. The heap is a private
+ *		anonymous mapping, so released pages simply read back as
+ *		zero if they are ever touched again.
+ */
+void mem_release(void *lo, size_t len){
+	madvise(lo, len, MADV_DONTNEED);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
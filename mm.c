@@ -5,13 +5,29 @@
  * Implementation of Malloc - The following solution implements
  * a memory allocator using segregated lists and best fits. All
  * the general operations are supported, malloc, free, realloc,
- * and calloc. 
- * There are 16 segregated lists used with different bin sizes,
- * which start linear and grow hyper-exponentially. 
+ * and calloc.
+ * There are 32 segregated lists: exact 8-byte-spaced bins up to
+ * 128 bytes, four geometrically-spaced bins per doubling up to
+ * 1KB, and treap bins above that.
+ *
+ * The allocator is thread-safe. The heap is divided into per-thread
+ * arenas: each arena owns its own segregated lists and wilderness
+ * block, carved out of the shared sbrk heap as one or more segments.
+ * Threads are bound to arenas round-robin, and every segment is
+ * bracketed by an allocated prologue/epilogue pair so coalescing
+ * never crosses an arena boundary. When an arena cannot extend the
+ * heap, it tries to steal a fit from the other arenas.
+ *
+ * Huge requests (>= MMAP_THRESHOLD) bypass the heap and are served
+ * from dedicated mmap regions tracked in a side table, so they are
+ * returned to the OS the moment they are freed.
+ *
+ * Small requests (<= SLABMAX) are served from page-aligned slab
+ * runs with no per-object headers: free() masks the pointer down
+ * to the run descriptor instead of reading boundary tags, so tiny
+ * objects pay no metadata at all.
  */
 
-/** SMALL-OPT for <=6 bytes **/
-
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,14 +35,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "contracts.h"
 
 #include "mm.h"
 #include "memlib.h"
+#include "clock.h"
 
 /* Basic constants and macros */
 #define VERBOSE 0
-#define HEAP_PRINT 1
 
 #define SMALL 0
 #define LARGE 4
@@ -43,8 +64,32 @@
 
 #define MINSIZE 8 /* Minimum block size (bytes) */
 #define MINWSIZE 16
-#define CHUNKSIZE 144 /* Extend heap by this amount (bytes) */
-#define SEGSIZE 16 /* Number of segregated lists */
+#define CHUNKSIZE 144 /* Initial minimum heap extension (bytes) */
+#define CHUNKMAX 32768 /* Cap for the adaptive extension size */
+#define SEGSIZE 32 /* Number of segregated lists */
+#define EXACTBIN 16 /* Bins below this hold a single size each */
+#define TREEBIN 28 /* First bin kept as a size-ordered treap */
+
+#define NARENAS 8 /* Number of thread arenas */
+#define SEGMAX 128 /* Max heap segments across all arenas */
+
+#ifndef DEFER_COALESCE
+#define DEFER_COALESCE 0 /* Default for the deferred-coalescing mode */
+#endif
+#define DEFER_FLUSH 1024 /* Deferred frees that trigger consolidation */
+
+#define MMAP_THRESHOLD 65536 /* Requests this big bypass the heap via mmap */
+#define MMAPMAX 1024 /* Initial capacity of the mmap side table */
+
+#define TCACHE_MAX 512 /* Largest block size served by the tcache */
+#define TCACHE_CLASSES (TCACHE_MAX/DSIZE) /* One class per block size */
+#define TCACHE_DEPTH 16 /* Cached blocks per class */
+
+#define RUNSIZE 4096 /* Bytes per slab run, and its alignment */
+#define SLABMAX 64 /* Largest request served from slab runs */
+#define SLABCLASSES (SLABMAX/DSIZE) /* One class per DSIZE step */
+
+#define NT_FRACTION 2 /* NT copies start at LLC size / this */
 
 #define passert(cond) if(!(cond)) print_checkheap(); assert(cond);
 
@@ -55,6 +100,8 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif
 
 /*
@@ -79,14 +126,329 @@
 /*
  * Global vars - (Defined early since they are used in inline functions)
  */
-static char *heap_start; /* Points to the start of the heap */
-static char *wilderness; /* Points to the wilderness */
-static char *heap_end; /* Points to the end of the heap */
-static uint32_t *seg_list;
 
-static uint32_t num = 0;
-static uint32_t tot = 0;
-static uint32_t alloc = 0;
+/*
+ * A thread arena. Each arena owns its own free lists and wilderness
+ * block; all of its state is guarded by its lock.
+ */
+typedef struct arena {
+    uint32_t seg_list[SEGSIZE]; /* Segregated free list heads */
+    uint32_t seg_mask; /* Occupancy bit per seg_list bin */
+    char *wilderness; /* Points to the arena's wilderness block */
+    char *heap_end; /* Points to the arena's epilogue */
+    char *clean; /* Below this, growing-segment memory may be dirty */
+    int seg_idx; /* Index of the arena's growing segment */
+    int ready; /* Has the arena carved its first segment? */
+    int deferred; /* Uncoalesced frees since the last consolidation */
+    size_t chunk; /* Next minimum extension, grows geometrically */
+    uint32_t run_head[SLABCLASSES]; /* Partial slab runs per class */
+    pthread_mutex_t lock;
+} arena_t;
+
+/*
+ * Maps a contiguous range of the heap to the arena that owns it.
+ * Entries are published once and never modified except to grow hi
+ * when the owning arena extends the top segment in place.
+ */
+typedef struct {
+    char *lo;
+    char *hi;
+    arena_t *owner;
+} segment_t;
+
+static arena_t arenas[NARENAS];
+static segment_t seg_map[SEGMAX];
+static int seg_count = 0;
+
+/* Serializes mem_sbrk and seg_map growth across arenas */
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Round-robin arena assignment for new threads */
+static int arena_next = 0;
+static __thread arena_t *my_arena = NULL;
+
+/*
+ * Side table of huge allocations served from dedicated mmap regions.
+ * These never touch the seg lists and go back to the OS on free.
+ */
+typedef struct {
+    char *addr;
+    size_t len;
+} mmap_ent_t;
+
+static mmap_ent_t *mmap_tab = NULL;
+static int mmap_cap = 0;
+static int mmap_used = 0;
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A slab run: one RUNSIZE-aligned page of small objects of a single
+ * size class, with no per-object headers. The descriptor lives at
+ * the start of the page, so free() finds it by masking the pointer
+ * and deduces the object size from it. Runs with open slots sit on
+ * a per-class list in the arena that owns the page; full runs leave
+ * the list and fully-free runs drain back to the heap.
+ */
+typedef struct {
+    uint32_t next; /* Partial-list links (heap offsets, 0 = none) */
+    uint32_t prev;
+    uint16_t size; /* Object size of this run's class */
+    uint16_t cap; /* Object slots in the run */
+    uint16_t inuse; /* Allocated slots */
+    uint16_t pad;
+    uint64_t map[DSIZE]; /* Slot occupancy; slots >= cap stay set */
+} run_t;
+
+/*
+ * One bit per heap page: does a slab run live there? Heap offsets
+ * fit in 32 bits (see get_offset), which bounds the table at 128KB.
+ * Bytes are updated atomically since arenas share them.
+ */
+static unsigned char run_map[(1UL << 32) / RUNSIZE / 8];
+
+/*
+ * Thread-local free-block cache. Blocks parked here keep their
+ * allocated headers, so a cache hit touches no shared state and no
+ * boundary tags - just a LIFO pop. Classes are exact block sizes in
+ * DSIZE steps. The generation counter lazily invalidates caches
+ * whenever mm_init resets the heap.
+ */
+typedef struct {
+    uint32_t gen;
+    uint8_t count[TCACHE_CLASSES];
+    void *bins[TCACHE_CLASSES][TCACHE_DEPTH];
+} tcache_t;
+
+static __thread tcache_t tcache;
+static uint32_t heap_gen = 0;
+
+/*
+ * Set when the last malloc on this thread returned provably-zero
+ * memory - fresh mmap pages, or a block carved off the untouched
+ * frontier of a growing segment. Lets calloc skip its memset.
+ */
+static __thread int alloc_was_clean = 0;
+
+/*
+ * Set while the allocator calls itself (carving and draining slab
+ * run pages), so internal traffic stays out of the user-facing
+ * statistics.
+ */
+static __thread int internal_call = 0;
+
+/*
+ * The block this thread most recently created or freed, validated
+ * by the incremental mode of mm_checkheap. The generation tag
+ * drops the pointer when mm_init resets the heap. Like the rest of
+ * checkheap this is a single-threaded debugging aid.
+ */
+static __thread void *last_touched = NULL;
+static __thread uint32_t touched_gen = 0;
+
+static inline void touch_block(void *bp)
+{
+    last_touched = bp;
+    touched_gen = heap_gen;
+}
+
+/*
+ * Full mm_checkheap sweeps run every check_interval-th call; the
+ * calls in between only validate the last-touched neighborhood.
+ */
+static unsigned check_interval = 1;
+static unsigned check_calls = 0;
+
+void mm_set_check_interval(unsigned n)
+{
+    check_interval = (n == 0) ? 1 : n;
+}
+
+/*
+ * When set, free() puts blocks on the bin lists uncoalesced and a
+ * consolidation pass merges adjacent runs later - either when
+ * find_fit comes up empty or after DEFER_FLUSH deferred frees.
+ * A latency win for phased workloads that free and re-malloc the
+ * same sizes, where eager coalescing is undone by the next split.
+ */
+static int defer_coalesce = DEFER_COALESCE;
+
+static void consolidate(arena_t *a);
+
+void mm_set_defer_coalesce(int on)
+{
+    /* Turning deferral off while frees are still parked would leave
+       adjacent free blocks that nothing merges anymore (and that
+       checkheap rightly rejects once the flag is clear), so flush
+       every arena's backlog on the way out */
+    if(defer_coalesce && !on)
+    {
+        for(int i = 0; i < NARENAS; i++)
+        {
+            arena_t *a = &arenas[i];
+            if(!a->ready)
+                continue;
+            pthread_mutex_lock(&a->lock);
+            if(a->deferred > 0)
+                consolidate(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    defer_coalesce = on;
+}
+
+/*
+ * Adaptive extension policy: every successful sbrk doubles the
+ * arena's next minimum extension, from chunk_min up to chunk_max,
+ * so a steady allocation ramp costs O(log n) sbrk round-trips
+ * instead of one per CHUNKSIZE worth of requests.
+ */
+static size_t chunk_min = CHUNKSIZE;
+static size_t chunk_max = CHUNKMAX;
+
+/*
+ * When nonzero, a wilderness block growing past this many bytes has
+ * its tail pages released back to the OS on the spot, so RSS tracks
+ * live bytes instead of the burst peak. mm_trim does the same on
+ * demand from a low-memory handler.
+ */
+static size_t trim_threshold = 0;
+
+/*
+ * Copies at least this big use non-temporal stores, since writing
+ * them through the cache would evict the working set with dying
+ * realloc source data. mm_init probes it from the last-level cache
+ * size (LLC / NT_FRACTION).
+ */
+static size_t nt_threshold = 0;
+
+void mm_set_trim_threshold(size_t bytes)
+{
+    trim_threshold = bytes;
+}
+
+void mm_set_chunk_limits(size_t min, size_t max)
+{
+    min = ((min + DSIZE - 1)/DSIZE)*DSIZE;
+    max = ((max + DSIZE - 1)/DSIZE)*DSIZE;
+    if(min < MINWSIZE)
+        min = MINWSIZE;
+    if(max < min)
+        max = min;
+    chunk_min = min;
+    chunk_max = max;
+}
+
+/*
+ * Allocation statistics, padded to their own cache line so the
+ * counters don't false-share with neighboring globals. Hot paths
+ * update them with plain stores; mm_get_stats snapshots them.
+ */
+static struct {
+    mm_stats_t s;
+    char pad[64];
+} __attribute__((aligned(64))) stats;
+
+/*
+ * Allocation tracing. Events go into a preallocated ring buffer
+ * claimed slot-by-slot with an atomic increment, so recording is
+ * lock-free and never blocks an allocation; once the ring wraps,
+ * the oldest events are overwritten. The buffer comes straight
+ * from mmap so tracing doesn't disturb the heap being traced.
+ */
+static mm_event_t *trace_buf = NULL;
+static size_t trace_cap = 0;
+static size_t trace_idx = 0;
+static volatile int trace_on = 0;
+
+static inline void trace_event(int op, size_t size, void *addr)
+{
+    if(!trace_on)
+        return;
+    size_t seq = __sync_fetch_and_add(&trace_idx, 1);
+    mm_event_t *e = &trace_buf[seq % trace_cap];
+    e->cycles = get_counter();
+    e->addr = addr;
+    e->size = size;
+    e->op = (unsigned)op;
+    e->seq = (unsigned)seq;
+}
+
+/*
+ * Arms tracing with a fresh ring of the given capacity, replacing
+ * any previous ring. Returns 0 on success, -1 on error.
+ */
+int mm_trace_start(size_t capacity)
+{
+    if(capacity == 0)
+        return -1;
+
+    trace_on = 0;
+    if(trace_buf != NULL)
+        munmap(trace_buf, trace_cap * sizeof(mm_event_t));
+
+    trace_buf = mmap(NULL, capacity * sizeof(mm_event_t),
+                     PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(trace_buf == MAP_FAILED)
+    {
+        trace_buf = NULL;
+        return -1;
+    }
+    trace_cap = capacity;
+    trace_idx = 0;
+    start_counter();
+    trace_on = 1;
+    return 0;
+}
+
+/*
+ * Stops recording. The ring keeps its contents for mm_trace_dump.
+ */
+void mm_trace_stop(void)
+{
+    trace_on = 0;
+}
+
+/*
+ * Writes the ring to path as binary mm_event_t records, oldest
+ * first. Returns the number of records written, or 0 on error.
+ */
+size_t mm_trace_dump(const char *path)
+{
+    if(trace_buf == NULL)
+        return 0;
+
+    FILE *f = fopen(path, "wb");
+    if(f == NULL)
+        return 0;
+
+    size_t count = trace_idx < trace_cap ? trace_idx : trace_cap;
+    size_t first = trace_idx < trace_cap ? 0 : trace_idx % trace_cap;
+    size_t wrote = 0;
+    for(size_t i = 0; i < count; i++)
+        wrote += fwrite(&trace_buf[(first + i) % trace_cap],
+                        sizeof(mm_event_t), 1, f);
+    fclose(f);
+    return wrote;
+}
+
+/*
+ * Snapshot the counters. heap_bytes is derived on the spot from
+ * the sbrk heap plus the live mmap regions.
+ */
+void mm_get_stats(mm_stats_t *out)
+{
+    *out = stats.s;
+    out->heap_bytes = mem_heapsize();
+    pthread_mutex_lock(&mmap_lock);
+    for(int i = 0; i < mmap_cap; i++)
+    {
+        if(mmap_tab[i].addr != NULL)
+            out->heap_bytes += mmap_tab[i].len;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+}
+
 /*
  *  Heap Check functions
  *  
@@ -148,10 +510,10 @@ static inline uint32_t get_offset(void* const p)
     REQUIRES(in_heap(p));
     
     uint64_t offset = (char*)p - (char*)mem_heap_lo();
-    ASSERT(offset < 1U << 31);
+    ASSERT(offset < 1ULL << 32);
    
-    /* Make sure offset doesn't corrupt seglist and prologue */
-    ASSERT(offset >= (SEGSIZE+2)*WSIZE);
+    /* Make sure offset doesn't corrupt a segment prologue */
+    ASSERT(offset >= 2*WSIZE);
     return (uint32_t) offset;
 }
 //Translate offset to address
@@ -325,6 +687,15 @@ static inline uint32_t getf_size(void* const p)
     else
         return get16(ftrp(p)) & ~(0x7);
 }
+//Set palloc bit of a block's header, mirroring it into the footer
+//when the block is free (free neighbors exist under deferred mode)
+static inline void set_palloc_blk(void* const p, uint16_t val)
+{
+    REQUIRES(in_heap(p) || (p == ((char*)mem_heap_hi()+1)));
+    set_palloc(hdrp(p), val);
+    if(get_alloc(hdrp(p)) == FREE)
+        set_palloc(ftrp(p), val);
+}
 
 /*
  * Segregated List functions
@@ -356,6 +727,126 @@ static inline void set_next(void* p, uint32_t val)
     REQUIRES(in_heap(p));
     set32((char*)(p) + WSIZE + DSIZE*get_large(hdrp(p)), val);
 }
+
+/*
+ * Treap bins
+ *
+ * Bins >= TREEBIN span wide size ranges, so they are kept as treaps
+ * threaded through the free blocks themselves instead of linear
+ * lists. The prev/next link slots double as left/right children,
+ * keys are (size, offset) pairs, and priorities are hashed from the
+ * block offset so no extra per-block storage is needed. Lookup,
+ * insert, and delete are all O(log n) in expectation.
+ */
+
+/* Pseudo-random heap priority for a block offset */
+static inline uint32_t tree_prio(uint32_t off)
+{
+    off ^= off >> 16;
+    off *= 0x45d9f3bu;
+    off ^= off >> 16;
+    return off;
+}
+
+/* Strict (size, offset) ordering between two free blocks */
+static inline bool tree_less(uint32_t x, uint32_t y)
+{
+    size_t sx = geth_size(get_address(x));
+    size_t sy = geth_size(get_address(y));
+    return sx < sy || (sx == sy && x < y);
+}
+
+static uint32_t tree_rotate_right(uint32_t t)
+{
+    uint32_t l = get_prev(get_address(t));
+    set_prev(get_address(t), get_next(get_address(l)));
+    set_next(get_address(l), t);
+    return l;
+}
+
+static uint32_t tree_rotate_left(uint32_t t)
+{
+    uint32_t r = get_next(get_address(t));
+    set_next(get_address(t), get_prev(get_address(r)));
+    set_prev(get_address(r), t);
+    return r;
+}
+
+/* Inserts node into the treap rooted at root; returns the new root */
+static uint32_t tree_insert(uint32_t root, uint32_t node)
+{
+    if(root == 0)
+    {
+        set_prev(get_address(node), 0);
+        set_next(get_address(node), 0);
+        return node;
+    }
+    void *rp = get_address(root);
+    if(tree_less(node, root))
+    {
+        set_prev(rp, tree_insert(get_prev(rp), node));
+        if(tree_prio(get_prev(rp)) < tree_prio(root))
+            root = tree_rotate_right(root);
+    }
+    else
+    {
+        set_next(rp, tree_insert(get_next(rp), node));
+        if(tree_prio(get_next(rp)) < tree_prio(root))
+            root = tree_rotate_left(root);
+    }
+    return root;
+}
+
+/* Merges two treaps where all keys in l precede all keys in r */
+static uint32_t tree_merge(uint32_t l, uint32_t r)
+{
+    if(l == 0)
+        return r;
+    if(r == 0)
+        return l;
+    if(tree_prio(l) < tree_prio(r))
+    {
+        set_next(get_address(l), tree_merge(get_next(get_address(l)), r));
+        return l;
+    }
+    set_prev(get_address(r), tree_merge(l, get_prev(get_address(r))));
+    return r;
+}
+
+/* Removes node from the treap rooted at root; returns the new root */
+static uint32_t tree_remove(uint32_t root, uint32_t node)
+{
+    ASSERT(root != 0);
+    void *rp = get_address(root);
+    if(root == node)
+        return tree_merge(get_prev(rp), get_next(rp));
+    if(tree_less(node, root))
+        set_prev(rp, tree_remove(get_prev(rp), node));
+    else
+        set_next(rp, tree_remove(get_next(rp), node));
+    return root;
+}
+
+/* Finds the smallest block with size >= asize, or NULL */
+static void *tree_bestfit(uint32_t root, size_t asize)
+{
+    void *best = NULL;
+    while(root != 0)
+    {
+        void *rp = get_address(root);
+        if(geth_size(rp) >= asize)
+        {
+            best = rp;
+            root = get_prev(rp);
+        }
+        else
+        {
+            root = get_next(rp);
+        }
+    }
+    return best;
+}
+
 /*
  *  Malloc Implementation
  *  ---------------------
@@ -363,50 +854,66 @@ static inline void set_next(void* p, uint32_t val)
  */
 
 /*
- * Get the corresponding index of the segregated list.
- */ 
+ * Bin for each size <= 1024, indexed by asize >> 3: exact classes
+ * spaced 8 bytes apart up to 128, then four classes per doubling.
+ */
+static const uint8_t small_bin[129] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 16, 16, 16, 17, 17, 17, 17, 18, 18, 18, 18, 19, 19, 19,
+    19, 20, 20, 20, 20, 20, 20, 20, 20, 21, 21, 21, 21, 21, 21, 21,
+    21, 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23,
+    23, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27
+};
+
+/*
+ * Get the corresponding index of the segregated list. A table
+ * lookup for sizes up to 1KB, a branch-free clz formula for the
+ * treap bins above it (two doublings per bin).
+ */
 static inline size_t get_index(size_t asize)
 {
     REQUIRES(asize >= MINSIZE);
-    
-    if(asize <= 48) return (asize >> 3) - 1;
-    if(asize <= 72) return 6;
-    if(asize <= 136) return 7;
-    if(asize <= 264) return 8;
-    if(asize <= 520) return 9;
-    if(asize <= 1032) return 10;
-    if(asize <= 2056) return 11;
-    if(asize <= 4104) return 12;
-    if(asize <= 16392) return 13;
-    if(asize <= 32774) return 14;
-    return 15;
+
+    if(asize <= 1024)
+        return small_bin[asize >> 3];
+
+    size_t k = 63 - __builtin_clzl(asize - 1);
+    size_t t = (k - 10) >> 1;
+    return t < 3 ? TREEBIN + t : SEGSIZE - 1;
 }
 
 /*
  * Adds free block to the appropriate seg-list
  */
-static void add_free_block(void *ptr)
+static void add_free_block(arena_t *a, void *ptr)
 {
-    REQUIRES(ptr != wilderness);
+    REQUIRES(ptr != a->wilderness);
     REQUIRES(get_alloc(hdrp(ptr)) == 0);
 
     /* Get ptr data */
     size_t size = geth_size(ptr);
+    REQUIRES(size >= MINWSIZE);
     size_t index = get_index(size);
-    uint32_t last = seg_list[index];
-    if(size <= 8)
-    {
-        seg_list[index] = get_offset(ptr);
+    uint32_t last = a->seg_list[index];
 
-        /* Update links */
-        set_prev(ptr, last);
+    /* Mark the bin occupied */
+    a->seg_mask |= 1u << index;
+
+    /* Upper bins are treaps */
+    if(index >= TREEBIN)
+    {
+        a->seg_list[index] = tree_insert(a->seg_list[index], get_offset(ptr));
         return;
     }
 
     /* If ptr is the start of the seg_list */
     if(last == 0)
     {
-        seg_list[index] = get_offset(ptr);
+        a->seg_list[index] = get_offset(ptr);
 
         /* Update links */
         set_prev(ptr, 0);
@@ -416,7 +923,7 @@ static void add_free_block(void *ptr)
     {
         /* ptr is somewhere in the middle */
         size_t offset = get_offset(ptr);
-        seg_list[index] = offset;
+        a->seg_list[index] = offset;
 
         /* Update links */
         set_prev(ptr, last);
@@ -424,42 +931,30 @@ static void add_free_block(void *ptr)
         set_next(get_address(last), offset);
     }
 
-    ASSERT(seg_list[index] != last);
+    ASSERT(a->seg_list[index] != last);
 }
 
 /*
  * Removes free block from the appropriate seg-list 
  */
-static inline void remove_free_block(void *ptr)
+static inline void remove_free_block(arena_t *a, void *ptr)
 {
     REQUIRES(get_alloc(hdrp(ptr)) == 0);
-    REQUIRES(ptr != wilderness);
+    REQUIRES(ptr != a->wilderness);
 
     /* Get ptr data */
     size_t size = geth_size(ptr);
+    REQUIRES(size >= MINWSIZE);
     size_t index = get_index(size);
-    uint32_t last = seg_list[index];
+    uint32_t last = a->seg_list[index];
     uint32_t offset = get_offset(ptr);
 
-    if(size <= 8)
+    /* Upper bins are treaps */
+    if(index >= TREEBIN)
     {
-        if(last == offset)
-        {
-            /* Pointer is the front of the seglist */
-            uint32_t prev = get_prev(ptr);
-            seg_list[index] = prev;
-        }
-        else
-        {
-            uint32_t curr = last;
-            uint32_t prev = 0;
-            while(curr != offset)
-            {
-                prev = curr;
-                curr = get_prev(get_address(curr));
-            }
-            set_prev(get_address(prev), get_prev(ptr));
-        }
+        a->seg_list[index] = tree_remove(a->seg_list[index], offset);
+        if(a->seg_list[index] == 0)
+            a->seg_mask &= ~(1u << index);
         return;
     }
 
@@ -467,7 +962,7 @@ static inline void remove_free_block(void *ptr)
     {
         /* Pointer is the front of the seglist */
         uint32_t prev = get_prev(ptr);
-        seg_list[index] = prev;
+        a->seg_list[index] = prev;
         if(prev != 0)
             set_next(get_address(prev),0);
     }
@@ -480,16 +975,19 @@ static inline void remove_free_block(void *ptr)
         {
             /* Update links */
             set_prev(get_address(get_next(ptr)),get_prev(ptr));
-            set_next(get_address(get_prev(ptr)),get_next(ptr));   
+            set_next(get_address(get_prev(ptr)),get_next(ptr));
         }
     }
+
+    if(a->seg_list[index] == 0)
+        a->seg_mask &= ~(1u << index);
 }
 
 /*
  * Coalesces adjacent free blocks into one free block
  * Removes the old free blocks from the appropriate seglists
  */
-static void *coalesce(void *bp)
+static void *coalesce(arena_t *a, void *bp)
 {
     REQUIRES(in_heap(bp));
     /* Get surrounding blocks */
@@ -511,8 +1009,8 @@ static void *coalesce(void *bp)
         size += geth_size(next);
 
         /* Wilderness case */
-        if(next != wilderness)
-            remove_free_block(next);
+        if(next != a->wilderness)
+            remove_free_block(a, next);
 
         /* Update headers */
         setH(bp, size, PALLOC, FREE);
@@ -525,8 +1023,8 @@ static void *coalesce(void *bp)
         size += geth_size(prev);
 
         /* Wilderness Case */
-        if(prev != wilderness)
-            remove_free_block(prev);
+        if(prev != a->wilderness)
+            remove_free_block(a, prev);
 
         /* Update headers */
         setH(prev, size, pr, FREE);
@@ -540,10 +1038,10 @@ static void *coalesce(void *bp)
         geth_size(next);
 
         /* Wilderness case */
-        if(prev != wilderness)
-            remove_free_block(prev);
-        if(next != wilderness)
-            remove_free_block(next);
+        if(prev != a->wilderness)
+            remove_free_block(a, prev);
+        if(next != a->wilderness)
+            remove_free_block(a, next);
 
         /* Update headers */
         setH(prev, size, PALLOC, FREE);
@@ -554,16 +1052,178 @@ static void *coalesce(void *bp)
     return bp;
 }
 
+/*
+ * Releases the tail pages of the arena's wilderness back to the OS,
+ * keeping at least pad bytes (and the boundary tags) resident. The
+ * released range reads back as zero, so the clean frontier can be
+ * pulled down over it. Returns the number of bytes released. The
+ * arena lock must be held.
+ */
+static size_t trim_arena(arena_t *a, size_t pad)
+{
+    if(!a->ready)
+        return 0;
+
+    char *w = a->wilderness;
+    if(pad < DSIZE)
+        pad = DSIZE; /* Never release the wide header's size word */
+    if(geth_size(w) <= pad)
+        return 0;
+
+    size_t pg = mem_pagesize();
+    char *lo = (char*)(((uintptr_t)(w + pad) + pg - 1) & ~(pg - 1));
+    char *hi = (char*)a->heap_end - 2*WSIZE - HSIZE;
+    hi = (char*)((uintptr_t)hi & ~(pg - 1));
+    if(lo >= hi)
+        return 0;
+
+    mem_release(lo, hi - lo);
+
+    /* The released pages are zero again */
+    if(a->clean != NULL && a->clean <= hi && a->clean > lo)
+        a->clean = lo;
+
+    return hi - lo;
+}
+
+/*
+ * When a block below the wilderness is freed and merges into it,
+ * the old wilderness start retires into the interior, leaving its
+ * 16-bit header and (if it was wide) its 32-bit size word behind
+ * as stale bytes. Normally those sit below the clean frontier, but
+ * trim_arena can pull a->clean down over the wilderness interior,
+ * and then the leftovers break the frontier's read-as-zero promise
+ * for calloc and the checkheap scan. Zero them after the merge.
+ * The scrub never goes below the new start's own exempt first
+ * DSIZE bytes, so the merged block's tags survive. The arena lock
+ * must be held and a->wilderness already moved to the new start.
+ */
+static void scrub_retired_wilderness(arena_t *a, char *old_w)
+{
+    char *lo = old_w - HSIZE;
+    char *hi = old_w + DSIZE;
+    if(lo < a->wilderness + DSIZE)
+        lo = a->wilderness + DSIZE;
+    if(a->clean == NULL || hi <= a->clean || lo >= hi)
+        return;
+    memset(lo, 0, hi - lo);
+}
+
+/*
+ * Releases the excess wilderness of every arena, keeping pad bytes
+ * per arena resident. Meant for low-memory handlers; returns the
+ * total number of bytes given back to the OS.
+ */
+size_t mm_trim(size_t pad)
+{
+    size_t total = 0;
+    for(int i = 0; i < NARENAS; i++)
+    {
+        arena_t *a = &arenas[i];
+        if(!a->ready)
+            continue;
+        pthread_mutex_lock(&a->lock);
+        total += trim_arena(a, pad);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return total;
+}
+
+/*
+ * Consolidation pass for deferred coalescing: sweeps the arena's
+ * segments and merges every run of adjacent free blocks, folding a
+ * run that reaches the wilderness back into it.
+ */
+static void consolidate(arena_t *a)
+{
+    for(int s = 0; s < seg_count; s++)
+    {
+        if(seg_map[s].owner != a)
+            continue;
+
+        char *bp = seg_map[s].lo + 2*WSIZE;
+        while(geth_size(bp) != 0)
+        {
+            char *next = next_blkp(bp);
+
+            /* Only free runs of two or more blocks need work */
+            if(get_alloc(hdrp(bp)) || bp == a->wilderness ||
+               get_alloc(hdrp(next)))
+            {
+                bp = next;
+                continue;
+            }
+
+            /* Merge the whole run starting at bp */
+            size_t total = geth_size(bp);
+            remove_free_block(a, bp);
+            while(!get_alloc(hdrp(next)) && next != a->wilderness)
+            {
+                remove_free_block(a, next);
+                total += geth_size(next);
+                next = next_blkp(next);
+            }
+
+            uint32_t pr = get_palloc(hdrp(bp));
+            if(next == a->wilderness)
+            {
+                /* The run reaches the wilderness; fold it in */
+                total += geth_size(next);
+                setH(bp, total, pr, FREE);
+                setF(bp, total, pr, FREE);
+                a->wilderness = bp;
+                scrub_retired_wilderness(a, next);
+                bp = next_blkp(bp);
+            }
+            else
+            {
+                setH(bp, total, pr, FREE);
+                setF(bp, total, pr, FREE);
+                add_free_block(a, bp);
+                bp = next;
+            }
+        }
+    }
+    a->deferred = 0;
+
+    /* Merging may have swallowed the block recorded for the
+       incremental heap check */
+    last_touched = NULL;
+
+    /* An oversized wilderness goes back to the OS */
+    if(trim_threshold != 0 && geth_size(a->wilderness) > trim_threshold)
+        trim_arena(a, trim_threshold);
+}
+
 /*
  * Finds a free block large enough to fit a block of size asize
- */ 
-static void *find_fit(size_t asize)
+ */
+static void *find_fit(arena_t *a, size_t asize)
 {
-    size_t index = get_index(asize); 
-    
-    /* Search through seg_lists, Perform best fit search */
-    for (int i = index; i < SEGSIZE; i++)
+    size_t index = get_index(asize);
+
+    /*
+     * Search through seg_lists, Perform best fit search.
+     * The occupancy mask lets us jump straight to the next
+     * non-empty bin instead of probing each head in turn.
+     */
+    uint32_t mask = a->seg_mask & (~0u << index);
+    while (mask != 0)
     {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        /* Upper bins: best fit is an O(log n) treap lookup */
+        if(i >= TREEBIN)
+        {
+            void *bp = tree_bestfit(a->seg_list[i], asize);
+            if(bp != NULL)
+            {
+                remove_free_block(a, bp);
+                return bp;
+            }
+            continue;
+        }
         /* 
          * Large block optimization:
          * For large blocks, we don't want small block sizes to eat
@@ -575,9 +1235,9 @@ static void *find_fit(size_t asize)
         //    break;
         
         /* Check if seg_list is empty */
-        if(seg_list[i] != 0)
+        if(a->seg_list[i] != 0)
         {
-            uint32_t p = seg_list[i];
+            uint32_t p = a->seg_list[i];
             void* address = get_address(p);
 
             ASSERT(get_alloc(hdrp(address)) == 0);
@@ -592,13 +1252,12 @@ static void *find_fit(size_t asize)
                 min = address_size - asize;
                 min_add = address;
                 /*
-                 * For seglist 0 to 5, the lists contain only one
-                 * size. Therefore if there exists a first element
-                 * we return it.  
+                 * The exact bins contain only one size. Therefore
+                 * if there exists a first element we return it.
                  */
-                if(i <= 5) 
+                if(i < EXACTBIN)
                 {
-                    remove_free_block(address);
+                    remove_free_block(a, address);
                     return address;
                 }
             }
@@ -624,16 +1283,16 @@ static void *find_fit(size_t asize)
             /* If there exists a minimum, we return the address */
             if(min_add != NULL)
             {
-                remove_free_block(min_add);
+                remove_free_block(a, min_add);
                 return min_add;
             }
         }
     }
 
     /* If no space in seglist, check the wilderness */
-    if (asize <= geth_size(wilderness) - MINWSIZE)
+    if (asize <= geth_size(a->wilderness) - MINWSIZE)
     {
-        return wilderness;
+        return a->wilderness;
     }
     return NULL; /* No fit */
 }
@@ -643,109 +1302,555 @@ static void *find_fit(size_t asize)
  * creating a free block if there is excess space an
  * adding it to the segregated list.
  */
-static void place(void *bp, size_t asize)
+static void place(arena_t *a, void *bp, size_t asize)
 {
     REQUIRES(in_heap(bp));
     REQUIRES(get_alloc(hdrp(bp))==FREE);
     size_t csize = geth_size(bp);
-    
+    /* The predecessor may be free under deferred coalescing */
+    uint32_t pr = get_palloc(hdrp(bp));
+    bool split = (csize - asize) >= MINWSIZE;
+
     bool flag = false;
-    if(bp == wilderness)
+    if(bp == a->wilderness)
         flag = true;
 
+    /*
+     * Frontier tracking for calloc: a block carved at or above the
+     * clean mark is untouched sbrk memory - unless the free block
+     * carried the wide header, whose size word sits in the payload.
+     * Whatever we hand out moves the mark up.
+     */
+    size_t hand = split ? asize : csize;
+    if(a->clean != NULL && (char*)bp + hand > a->clean)
+    {
+        alloc_was_clean = ((char*)bp >= a->clean &&
+                           !get_large(hdrp(bp)));
+        a->clean = (char*)bp + hand;
+    }
+
     /* Check if there is enough space for another block */
-    if ((csize - asize) >= MINWSIZE) {
+    if (split) {
         /* Set current block as allocated */
-        setH(bp, asize, PALLOC, ALLOC);
-        
+        setH(bp, asize, pr, ALLOC);
+
         /* Separate block to create a new free block */
         bp = next_blkp(bp);
         setH(bp, csize-asize, PALLOC, FREE);
         setF(bp, csize-asize, PALLOC, FREE);
-        set_palloc(hdrp(next_blkp(bp)), PFREE);
+        set_palloc_blk(next_blkp(bp), PFREE);
         /* Add to free list if its not in the wilderness */
         if(!flag)
-            add_free_block(bp);
+            add_free_block(a, bp);
         else
-            wilderness = bp;
+            a->wilderness = bp;
     }
     else {
         /* Wilderness block should NEVER reach here */
-        ASSERT(geth_size(wilderness) >= MINWSIZE);
+        ASSERT(geth_size(a->wilderness) >= MINWSIZE);
 
         /* Otherwise set allocated block */
-        setH(bp, csize, PALLOC, ALLOC);
-        setF(bp, csize, PALLOC, ALLOC);
-        set_palloc(hdrp(next_blkp(bp)), PALLOC);
+        setH(bp, csize, pr, ALLOC);
+        setF(bp, csize, pr, ALLOC);
+        set_palloc_blk(next_blkp(bp), PALLOC);
     }
+
+    touch_block(bp);
 }
 
 /*
- * Extends the heap by a fixed size
+ * Publishes a new seg_map entry for the given range.
+ * Must be called with sbrk_lock held.
  */
-static void *extend_heap(size_t words)
+static void map_segment(arena_t *a, char *lo, char *hi)
+{
+    ASSERT(seg_count < SEGMAX);
+    seg_map[seg_count].lo = lo;
+    seg_map[seg_count].hi = hi;
+    seg_map[seg_count].owner = a;
+    a->seg_idx = seg_count;
+    __sync_synchronize();
+    seg_count++;
+}
+
+/*
+ * Finds the arena owning the given heap address.
+ */
+static inline arena_t *arena_for(void *ptr)
+{
+    for(int i = 0; i < seg_count; i++)
+    {
+        if((char*)ptr >= seg_map[i].lo && (char*)ptr < seg_map[i].hi)
+            return seg_map[i].owner;
+    }
+    return NULL;
+}
+
+/*
+ * Starts a fresh heap segment for an arena. The segment gets the
+ * same pad/prologue pair mm_init used to write, so coalescing can
+ * never walk across a segment boundary, and the old wilderness
+ * (which can no longer grow) is retired to the seg lists.
+ */
+static void *new_segment(arena_t *a, char *bp, size_t size)
+{
+    set16(bp, 0); /* Alignment padding */
+    setH(bp + WSIZE, 0, PFREE, ALLOC); /* Prologue header */
+    setF(bp + WSIZE, 0, PFREE, ALLOC); /* Prologue footer */
+
+    char *blk = bp + 2*WSIZE;
+    size_t bsize = size - 2*WSIZE;
+    setH(blk, bsize, PALLOC, FREE); /* Free block header */
+    setF(blk, bsize, PALLOC, FREE); /* Free block footer */
+    a->heap_end = next_blkp(blk);
+    setH(a->heap_end, 0, PFREE, ALLOC); /* Epilogue header */
+
+    /* Everything past the initial tags is untouched sbrk memory */
+    a->clean = blk;
+
+    if(a->ready)
+    {
+        /* Retire the stranded wilderness to the free lists */
+        char *old = a->wilderness;
+        a->wilderness = blk;
+        add_free_block(a, old);
+    }
+    else
+    {
+        a->wilderness = blk;
+        a->ready = 1;
+    }
+
+    map_segment(a, bp, bp + size);
+    return blk;
+}
+
+/*
+ * Extends the arena's heap so a block of asize fits in the
+ * wilderness. Grows the top segment in place when the arena still
+ * owns the top of the heap, and starts a new segment otherwise.
+ */
+static void *extend_heap(arena_t *a, size_t asize)
 {
     char *bp;
     size_t size;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+    pthread_mutex_lock(&sbrk_lock);
+
+    /* Check whether our epilogue still sits at the top of the heap */
+    bool contig = a->ready && ((char*)mem_sbrk(0) == a->heap_end);
+
+    if(contig)
+    {
+        /* Credit the wilderness against the needed extension */
+        size_t wild = geth_size(a->wilderness);
+        size = asize;
+        if(asize >= wild - MINWSIZE)
+            size -= wild - MINWSIZE;
+        if(size < a->chunk)
+            size = a->chunk;
+
+        if ((long)(bp = mem_sbrk(size)) == -1)
+        {
+            pthread_mutex_unlock(&sbrk_lock);
+            return NULL;
+        }
+
+        /* Grow the next extension geometrically */
+        a->chunk <<= 1;
+        if(a->chunk > chunk_max)
+            a->chunk = chunk_max;
+
+        /* Initialize free block header/footer and the epilogue header */
+        char *old_end = a->heap_end;
+        uint32_t pa = get_alloc(hdrp(a->wilderness));
+        setH(bp, size, PALLOC*pa, FREE); /* Free block header */
+        setF(bp, size, PALLOC*pa, FREE); /* Free block footer */
+        a->heap_end = next_blkp(bp);
+        setH(a->heap_end, 0, PFREE, ALLOC); /* New epilogue header */
+        seg_map[a->seg_idx].hi = a->heap_end;
+
+        pthread_mutex_unlock(&sbrk_lock);
+
+        /* Coalesce if the previous block was free */
+        bp = coalesce(a, bp);
+
+        /* The old wilderness footer and epilogue header are interior
+           bytes of the merged wilderness now; scrub them so the
+           clean frontier stays zero for calloc */
+        if(pa == 0)
+            memset(old_end - 2*WSIZE - HSIZE, 0, 2*WSIZE + HSIZE);
+
+        return bp;
+    }
+
+    /* Leave room to split a wilderness remainder off the new block */
+    size = asize + MINWSIZE;
+    if(size < a->chunk)
+        size = a->chunk;
+    size += 2*WSIZE; /* Segment pad + prologue overhead */
+
     if ((long)(bp = mem_sbrk(size)) == -1)
+    {
+        pthread_mutex_unlock(&sbrk_lock);
         return NULL;
-    
-    alloc += size;
+    }
+
+    /* Grow the next extension geometrically */
+    a->chunk <<= 1;
+    if(a->chunk > chunk_max)
+        a->chunk = chunk_max;
+
+    void *blk = new_segment(a, bp, size);
+    pthread_mutex_unlock(&sbrk_lock);
+    return blk;
+}
+
+/*
+ * Tries to satisfy a request from the other arenas once our own
+ * arena is exhausted. Uses trylock so two stealing threads can
+ * never deadlock against each other.
+ */
+static void *steal_fit(arena_t *self, size_t asize)
+{
+    for(int i = 0; i < NARENAS; i++)
+    {
+        arena_t *b = &arenas[i];
+        if(b == self || !b->ready)
+            continue;
+        if(pthread_mutex_trylock(&b->lock) != 0)
+            continue;
+        void *bp = find_fit(b, asize);
+        if(bp != NULL)
+            place(b, bp, asize);
+        pthread_mutex_unlock(&b->lock);
+        if(bp != NULL)
+            return bp;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the run owning ptr, or NULL if ptr is an ordinary block.
+ * ptr must be inside the heap.
+ */
+static inline run_t *run_of(void* const ptr)
+{
+    REQUIRES(in_heap(ptr));
+    char *page = (char*)((uintptr_t)ptr & ~((uintptr_t)RUNSIZE - 1));
+    /* The descriptor itself is never an object */
+    if(page == (char*)ptr)
+        return NULL;
+    size_t idx = (size_t)(page - (char*)mem_heap_lo()) / RUNSIZE;
+    if(run_map[idx >> 3] & (1u << (idx & 7)))
+        return (run_t*)page;
+    return NULL;
+}
+
+/* Pushes a run onto its class's partial list. Arena lock held. */
+static void run_link(arena_t *a, run_t *run)
+{
+    size_t c = run->size/DSIZE - 1;
+    uint32_t off = get_offset(run);
+    run->prev = 0;
+    run->next = a->run_head[c];
+    if(run->next != 0)
+        ((run_t*)get_address(run->next))->prev = off;
+    a->run_head[c] = off;
+}
+
+/* Removes a run from its class's partial list. Arena lock held. */
+static void run_unlink(arena_t *a, run_t *run)
+{
+    size_t c = run->size/DSIZE - 1;
+    if(run->prev != 0)
+        ((run_t*)get_address(run->prev))->next = run->next;
+    else
+        a->run_head[c] = run->next;
+    if(run->next != 0)
+        ((run_t*)get_address(run->next))->prev = run->prev;
+}
+
+/*
+ * Serves a small request from a slab run, carving a fresh run when
+ * the class has no open slots. Returns NULL if the heap is full;
+ * the caller falls back to an ordinary headered block.
+ */
+static void *slab_alloc(size_t size)
+{
+    size_t c = (size + DSIZE - 1)/DSIZE - 1;
+    ASSERT(c < SLABCLASSES);
+
+    /* Bind the thread to its arena */
+    arena_t *a = my_arena;
+    if(a == NULL)
+        a = my_arena = &arenas[__sync_fetch_and_add(&arena_next, 1) % NARENAS];
+
+    pthread_mutex_lock(&a->lock);
+
+    if(a->run_head[c] == 0)
+    {
+        pthread_mutex_unlock(&a->lock);
+
+        /* Carve a page-aligned run out of the heap */
+        internal_call = 1;
+        run_t *run = memalign(RUNSIZE, RUNSIZE);
+        internal_call = 0;
+        if(run == NULL)
+            return NULL;
+        memset(run, 0, sizeof(*run));
+        run->size = (uint16_t)((c + 1)*DSIZE);
+        run->cap = (uint16_t)((RUNSIZE - sizeof(run_t)) / run->size);
+
+        /* Slots past the capacity never open up */
+        for(size_t i = run->cap; i < 8*sizeof(run->map); i++)
+            run->map[i >> 6] |= 1ULL << (i & 63);
+
+        /* Register the page so free() can recognize its objects */
+        size_t idx = (size_t)((char*)run - (char*)mem_heap_lo()) / RUNSIZE;
+        __sync_fetch_and_or(&run_map[idx >> 3],
+                            (unsigned char)(1u << (idx & 7)));
+
+        /* The page may have been stolen from another arena */
+        a = arena_for(run);
+        ASSERT(a != NULL);
+        pthread_mutex_lock(&a->lock);
+        run_link(a, run);
+    }
+
+    run_t *run = (run_t*)get_address(a->run_head[c]);
+    ASSERT(run->inuse < run->cap);
+
+    /* Grab the first open slot */
+    size_t slot = 0;
+    for(int w = 0; w < DSIZE; w++)
+    {
+        if(~run->map[w] != 0)
+        {
+            slot = w*64 + __builtin_ctzll(~run->map[w]);
+            break;
+        }
+    }
+    run->map[slot >> 6] |= 1ULL << (slot & 63);
 
-    /* Initialize free block header/footer and the epilogue header */
-    uint32_t a = get_alloc(hdrp(wilderness));
-    setH(bp, size, PALLOC*a, FREE); /* Free block header */
-    setF(bp, size, PALLOC*a, FREE); /* Free block footer */
-    heap_end = next_blkp(bp);
-    setH(heap_end, 0, PFREE, ALLOC); /* New epilogue header */
+    /* Full runs leave the partial list */
+    if(++run->inuse == run->cap)
+        run_unlink(a, run);
 
-    /* Coalesce if the previous block was free */
-    return coalesce(bp);
+    pthread_mutex_unlock(&a->lock);
+    stats.s.bytes_live += run->size;
+    return (char*)run + sizeof(run_t) + slot*run->size;
+}
+
+/*
+ * Returns a slab object to its run. A full run rejoins the partial
+ * list; a fully-free run's page goes back to the heap.
+ */
+static void slab_free(void *ptr, run_t *run)
+{
+    arena_t *a = arena_for(run);
+    ASSERT(a != NULL);
+
+    pthread_mutex_lock(&a->lock);
+
+    size_t slot = ((size_t)((char*)ptr - (char*)run) - sizeof(run_t))
+                  / run->size;
+    ASSERT(run->map[slot >> 6] & (1ULL << (slot & 63)));
+    run->map[slot >> 6] &= ~(1ULL << (slot & 63));
+
+    if(run->inuse-- == run->cap)
+        run_link(a, run);
+
+    if(run->inuse == 0)
+    {
+        /* The page drains back to the heap as an ordinary block */
+        run_unlink(a, run);
+        size_t idx = (size_t)((char*)run - (char*)mem_heap_lo()) / RUNSIZE;
+        __sync_fetch_and_and(&run_map[idx >> 3],
+                             (unsigned char)~(1u << (idx & 7)));
+        pthread_mutex_unlock(&a->lock);
+        internal_call = 1;
+        free(run);
+        internal_call = 0;
+        return;
+    }
+
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Doubles the side table so huge requests never fail just because
+ * many are live at once. New entries arrive zeroed (anonymous mmap).
+ * Called with mmap_lock held; returns 0 only if mmap itself fails.
+ */
+static int mmap_tab_grow(void)
+{
+    int ncap = (mmap_cap == 0) ? MMAPMAX : 2*mmap_cap;
+    mmap_ent_t *ntab = mmap(NULL, ncap*sizeof(mmap_ent_t),
+                            PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(ntab == MAP_FAILED)
+        return 0;
+    if(mmap_tab != NULL)
+    {
+        memcpy(ntab, mmap_tab, mmap_cap*sizeof(mmap_ent_t));
+        munmap(mmap_tab, mmap_cap*sizeof(mmap_ent_t));
+    }
+    mmap_tab = ntab;
+    mmap_cap = ncap;
+    return 1;
+}
+
+/*
+ * Serves a huge request from its own page-rounded mmap region and
+ * records it in the side table so free/realloc can recognize it.
+ */
+static void *mmap_alloc(size_t size)
+{
+    size_t pg = mem_pagesize();
+    size_t len = ((size + pg - 1)/pg)*pg;
+
+    pthread_mutex_lock(&mmap_lock);
+    int slot = -1;
+    for(int i = 0; i < mmap_cap; i++)
+    {
+        if(mmap_tab[i].addr == NULL)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if(slot < 0)
+    {
+        /* Table full (or not yet allocated): double it. The table
+           itself comes straight from mmap, never from the heap, so
+           growing it cannot recurse into the allocator. */
+        slot = mmap_cap;
+        if(!mmap_tab_grow())
+        {
+            pthread_mutex_unlock(&mmap_lock);
+            return NULL;
+        }
+    }
+    void *p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        return NULL;
+    }
+    mmap_tab[slot].addr = p;
+    mmap_tab[slot].len = len;
+    mmap_used++;
+    pthread_mutex_unlock(&mmap_lock);
+    stats.s.bytes_live += len;
+    return p;
+}
+
+/* Region length of an mmap-served pointer, or 0 if not one */
+static size_t mmap_length(void *ptr)
+{
+    if(mmap_used == 0)
+        return 0;
+    size_t len = 0;
+    pthread_mutex_lock(&mmap_lock);
+    for(int i = 0; i < mmap_cap; i++)
+    {
+        if(mmap_tab[i].addr == ptr)
+        {
+            len = mmap_tab[i].len;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mmap_lock);
+    return len;
+}
+
+/*
+ * Unmaps an mmap-served block and clears its table entry. Returns
+ * the region length, or 0 if the pointer was not mmap-served.
+ */
+static size_t mmap_release(void *ptr)
+{
+    if(mmap_used == 0)
+        return 0;
+    size_t len = 0;
+    pthread_mutex_lock(&mmap_lock);
+    for(int i = 0; i < mmap_cap; i++)
+    {
+        if(mmap_tab[i].addr == ptr)
+        {
+            len = mmap_tab[i].len;
+            munmap(mmap_tab[i].addr, len);
+            mmap_tab[i].addr = NULL;
+            mmap_used--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mmap_lock);
+    return len;
 }
 
 /*
  * Initialize: return -1 on error, 0 on success.
- * 
- * Initializes the heap, creating 
+ *
+ * Resets the arenas and the segment map. No heap memory is carved
+ * here; each arena lazily creates its first segment on first use.
  */
 int mm_init(void) {
-    /* Create the initial empty heap */
-    if ((heap_start = mem_sbrk((2+SEGSIZE)*WSIZE)) == (void *)-1)
-        return -1;
-
-    alloc += 72;
+    static int locks_ready = 0;
+    if(!locks_ready)
+    {
+        for(int i = 0; i < NARENAS; i++)
+            pthread_mutex_init(&arenas[i].lock, NULL);
+        locks_ready = 1;
+    }
 
-    /* Initialize seg_list */
-    seg_list = (uint32_t*)heap_start;
-    for(int i = 0; i<SEGSIZE; i++)
-        set32(heap_start + (i*WSIZE), 0);
-    
-    heap_start += SEGSIZE*WSIZE;
+    for(int i = 0; i < NARENAS; i++)
+    {
+        arena_t *a = &arenas[i];
+        for(int j = 0; j < SEGSIZE; j++)
+            a->seg_list[j] = 0;
+        a->seg_mask = 0;
+        a->wilderness = NULL;
+        a->heap_end = NULL;
+        a->seg_idx = -1;
+        a->ready = 0;
+        a->deferred = 0;
+        a->clean = NULL;
+        a->chunk = chunk_min;
+        for(int j = 0; j < SLABCLASSES; j++)
+            a->run_head[j] = 0;
+    }
+    seg_count = 0;
+    memset(run_map, 0, sizeof(run_map));
 
-    /* Set buffer header */
-    set16(heap_start, 0); /* Alignment padding */
-    /*
-        We set prologue header size 0 instead of 4, since 4
-        inteferes with a restricted bit (large bit).
-    */
-    setH(heap_start + (WSIZE), 0, PFREE, ALLOC); /* Prologue header */
-    setF(heap_start + (WSIZE), 0, PFREE, ALLOC); /* Prologue footer */
-    setH(heap_start + (2*WSIZE), 0, PALLOC, ALLOC); /* Epilogue header */
-    
-    alloc += 8;
+    /* Release any mmap regions left over from a previous run */
+    for(int i = 0; i < mmap_cap; i++)
+    {
+        if(mmap_tab[i].addr != NULL)
+        {
+            munmap(mmap_tab[i].addr, mmap_tab[i].len);
+            mmap_tab[i].addr = NULL;
+        }
+    }
+    mmap_used = 0;
 
-    /* Set global pointers */
-    heap_start += WSIZE;
-    heap_end = heap_start + WSIZE;
+    memset(&stats.s, 0, sizeof(stats.s));
 
-    wilderness = heap_start + WSIZE;
+    /* Probe the cache hierarchy once for the copy kernel */
+    if(nt_threshold == 0)
+    {
+        long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        if(llc <= 0)
+            llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        if(llc <= 0)
+            llc = 1 << 21;
+        nt_threshold = (size_t)llc / NT_FRACTION;
+    }
 
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-        return -1;
+    /* Invalidate every thread's tcache */
+    heap_gen++;
     return 0;
 }
 
@@ -757,129 +1862,460 @@ int mm_init(void) {
 void *malloc (size_t size) {
     checkheap(VERBOSE);  // Let's make sure the heap is ok!
     size_t asize; /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     char *bp;
-    if(HEAP_PRINT)
-        printf("Num %u. Usage: %u.  Allocated: %u. Efficiency: %f. %zu\n", num, tot, alloc, (double)tot/alloc, size);
-    num++;
-    tot += size;
+    alloc_was_clean = 0;
+    if(!internal_call)
+    {
+        stats.s.mallocs++;
+        stats.s.bytes_requested += size;
+    }
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
 
+    /* Small requests come from headerless slab runs */
+    if(size <= SLABMAX)
+    {
+        bp = slab_alloc(size);
+        if(bp != NULL)
+        {
+            trace_event('m', size, bp);
+            return bp;
+        }
+        /* No room for a fresh run; fall through to the heap */
+    }
+
     /* Adjust block size to include overhead and alignment reqs. */
 
     asize = ((size+1)/DSIZE)*DSIZE + DSIZE;
-    if(asize >= 65536)
+    /*
+     * Blocks below MINWSIZE cannot hold both free-list links, which
+     * would force singly-linked bins with O(n) removal. Round tiny
+     * requests up so every free block is doubly-linked.
+     */
+    if(asize < MINWSIZE)
+        asize = MINWSIZE;
+
+    /* Huge requests bypass the heap entirely */
+    if(asize >= MMAP_THRESHOLD)
     {
-        asize += 2*DSIZE;
-        /* Search the free list for a fit */
-        if ((bp = find_fit(asize)) != NULL) {
-            place(bp, asize);
-            return (char*)bp + DSIZE;
-        }
-        else
-        {
-            /* No fit found. Get more memory and place the block */
-
-            /* Check the wilderness for space */
-            size_t wild = geth_size(wilderness);
-            size_t nsize = asize;
-            if(asize >= wild - MINWSIZE)
-                nsize -= wild - MINWSIZE;
-            
-            /* We allocate at least the chunksize */
-            extendsize = nsize > CHUNKSIZE ? nsize : CHUNKSIZE;
-            if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-                return NULL;
-            place(bp, asize);
-            return (char*)bp + DSIZE;
-        }
+        bp = mmap_alloc(size);
+        /* Fresh anonymous pages arrive zeroed */
+        alloc_was_clean = (bp != NULL);
+        trace_event('m', size, bp);
+        return bp;
     }
-    else
+
+    /* Check the thread-local cache first: a hit costs just a pop */
+    if(asize <= TCACHE_MAX && tcache.gen == heap_gen)
     {
-        /* Search the free list for a fit */
-        if ((bp = find_fit(asize)) != NULL) {
-            place(bp, asize);
-            return bp;
-        }
-        else
+        size_t cls = asize/DSIZE - 1;
+        if(tcache.count[cls] != 0)
         {
-            /* No fit found. Get more memory and place the block */
-
-            /* Check the wilderness for space */
-            size_t wild = geth_size(wilderness);
-            size_t nsize = asize;
-            if(asize >= wild - MINWSIZE)
-                nsize -= wild - MINWSIZE;
-            
-            /* We allocate at least the chunksize */
-            extendsize = nsize > CHUNKSIZE ? nsize : CHUNKSIZE;
-            if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-                return NULL;
-            place(bp, asize);
+            stats.s.bytes_live += asize;
+            bp = tcache.bins[cls][--tcache.count[cls]];
+            trace_event('m', size, bp);
             return bp;
         }
     }
+
+    /* Bind the thread to its arena */
+    arena_t *a = my_arena;
+    if(a == NULL)
+        a = my_arena = &arenas[__sync_fetch_and_add(&arena_next, 1) % NARENAS];
+
+    pthread_mutex_lock(&a->lock);
+
+    /* Search the free list for a fit */
+    bp = a->ready ? find_fit(a, asize) : NULL;
+
+    /* A failed fit flushes any deferred frees and retries */
+    if (bp == NULL && a->ready && a->deferred != 0) {
+        consolidate(a);
+        bp = find_fit(a, asize);
+    }
+
+    if (bp != NULL) {
+        place(a, bp, asize);
+    }
+    else if ((bp = extend_heap(a, asize)) != NULL) {
+        /* No fit found. Get more memory and place the block */
+        place(a, bp, asize);
+    }
+    else {
+        /* Arena exhausted; try the other arenas */
+        bp = steal_fit(a, asize);
+    }
+
+    pthread_mutex_unlock(&a->lock);
+
+    if(bp != NULL && !internal_call)
+        stats.s.bytes_live += geth_size(bp);
+    trace_event('m', size, bp);
+    return bp;
 }
 
+void print_checkheap();
+
 /*
- * Free routine.
- *
- * Frees the memory at a given pointer, and creates a new free block.
+ * Hardened-mode validation, run on every free and realloc before any
+ * list surgery. The 16-bit headers have no spare bits for a checksum,
+ * but the palloc mirror in the following header is one by another
+ * name: an application overrun that smashes a neighboring header
+ * breaks the mirror, and a bogus or stale pointer fails the shape
+ * checks. A handful of ALU ops and one extra header load, so it
+ * stays on in release builds; a mismatch dumps the usual checkheap
+ * diagnostics instead of corrupting the free lists.
  */
-void free (void *ptr) {
-    REQUIRES(ptr == NULL || (in_heap(ptr) && get_alloc(hdrp(ptr))));
-    checkheap(VERBOSE);
-    
-    /* If pointer is null, return */    
-    if (ptr == NULL) {
-        return;
-    }
-    uint32_t is_large = get_large(hdrp(ptr));
-    if(is_large)
+static inline void harden_check(void *ptr)
+{
+    size_t size = geth_size(ptr);
+    char *next = (char*)ptr + size;
+
+    if(!aligned(ptr) || !get_alloc(hdrp(ptr)) || size < MINWSIZE ||
+       !in_heap(next - 1) || get_palloc(hdrp(next)) != PALLOC)
     {
-        ptr = (char*)(ptr) - DSIZE;
+        printf("mm: corrupt block %p (size %zu) detected on free\n",
+               ptr, size);
+        print_checkheap();
+        exit(-1);
     }
+}
+
+/*
+ * Returns a block to its arena's free lists, coalescing with its
+ * neighbors. This is the slow path behind free() and the tcache.
+ */
+static void free_block(void *ptr) {
+    REQUIRES(in_heap(ptr) && get_alloc(hdrp(ptr)));
+
     size_t size = geth_size(ptr);
-    if(HEAP_PRINT)
-        printf("Num %u. Usage: %u.  Allocated: %u. Efficiency: %f. -%zu\n", num, tot, alloc, (double)tot/alloc, size);
-    tot -= size;
+
+    /* Look up the arena owning this block */
+    arena_t *a = arena_for(ptr);
+    ASSERT(a != NULL);
+
+    pthread_mutex_lock(&a->lock);
 
     uint32_t pr = get_palloc(hdrp(ptr));
     /* Set allocated to 0 */
     setH(ptr, size, pr, FREE);
     setF(ptr, size, pr, FREE);
-    set_palloc(hdrp(next_blkp(ptr)), PFREE);
+    set_palloc_blk(next_blkp(ptr), PFREE);
+
+    if(defer_coalesce)
+    {
+        /* Park the block uncoalesced; consolidation merges it later */
+        add_free_block(a, ptr);
+        touch_block(ptr);
+        if(++a->deferred >= DEFER_FLUSH)
+            consolidate(a);
+        pthread_mutex_unlock(&a->lock);
+        return;
+    }
+
     /* Handle reset of wilderness */
 
-    /* Check if pointer is behind the wilderness 
+    /* Check if pointer is behind the wilderness
        since during free, it will be coalesced */
     bool flag = false;
-    if(get_palloc(hdrp(wilderness)) == PFREE && ptr == prev_blkp(wilderness))
-        flag = true;  
-    
-    ptr = coalesce(ptr);
-    
+    char *old_w = a->wilderness;
+    if(get_palloc(hdrp(a->wilderness)) == PFREE && ptr == prev_blkp(a->wilderness))
+        flag = true;
+
+    ptr = coalesce(a, ptr);
+
     /* If pointer is not in the wilderness, add it to the seg_list */
     if(flag)
-        wilderness = ptr;
+    {
+        a->wilderness = ptr;
+        scrub_retired_wilderness(a, old_w);
+        /* An oversized wilderness goes back to the OS */
+        if(trim_threshold != 0 && geth_size(ptr) > trim_threshold)
+            trim_arena(a, trim_threshold);
+    }
     else
     {
-        add_free_block(ptr);
+        add_free_block(a, ptr);
         set_palloc(hdrp(next_blkp(ptr)), PFREE);
     }
-    checkheap(VERBOSE);
+    touch_block(ptr);
+
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Free routine.
+ *
+ * Frees the memory at a given pointer. Small blocks are parked in
+ * the thread-local cache with their headers untouched; everything
+ * else is returned to its arena.
+ */
+void free (void *ptr) {
+    checkheap(VERBOSE);
+
+    /* If pointer is null, return */
+    if (ptr == NULL) {
+        return;
+    }
+
+    if(!internal_call)
+        stats.s.frees++;
+    trace_event('f', 0, ptr);
+
+    /* Huge blocks live in their own mmap regions */
+    size_t mlen = mmap_release(ptr);
+    if(mlen != 0)
+    {
+        stats.s.bytes_live -= mlen;
+        return;
+    }
+
+    REQUIRES(in_heap(ptr));
+
+    /* Slab objects carry no header; mask down to the descriptor */
+    run_t *run = run_of(ptr);
+    if(run != NULL)
+    {
+        stats.s.bytes_live -= run->size;
+        slab_free(ptr, run);
+        return;
+    }
+
+    harden_check(ptr);
+    size_t size = geth_size(ptr);
+    if(!internal_call)
+        stats.s.bytes_live -= size;
+
+    if(size <= TCACHE_MAX)
+    {
+        if(tcache.gen != heap_gen)
+        {
+            /* The heap was reset since we last looked; drop the cache */
+            memset(tcache.count, 0, sizeof(tcache.count));
+            tcache.gen = heap_gen;
+        }
+
+        size_t cls = size/DSIZE - 1;
+        if(tcache.count[cls] == TCACHE_DEPTH)
+        {
+            /* Cache full: flush the older half back to the arenas */
+            for(int i = 0; i < TCACHE_DEPTH/2; i++)
+                free_block(tcache.bins[cls][i]);
+            memmove(&tcache.bins[cls][0], &tcache.bins[cls][TCACHE_DEPTH/2],
+                    (TCACHE_DEPTH/2)*sizeof(void*));
+            tcache.count[cls] = TCACHE_DEPTH/2;
+        }
+        tcache.bins[cls][tcache.count[cls]++] = ptr;
+        return;
+    }
+
+    free_block(ptr);
+    checkheap(VERBOSE);
+}
+
+/* Address-order comparator for mm_free_batch */
+static int ptr_cmp(const void *x, const void *y)
+{
+    char *a = *(char * const *)x;
+    char *b = *(char * const *)y;
+    return (a > b) - (a < b);
+}
+
+/*
+ * Batch free routine.
+ *
+ * Releases n blocks in one pass. The caller's array is sorted in
+ * place by address, so blocks that happen to be physically adjacent
+ * become neighbors in the batch and are merged into one free region
+ * before the seg lists are touched: a run of k adjacent blocks costs
+ * one coalesce and one list insertion instead of k, and each arena
+ * lock is taken once per run rather than once per block. The tcache
+ * is bypassed since a bulk teardown rarely sees its blocks again.
+ * NULL entries are ignored; mmap-served blocks go back to the OS.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    checkheap(VERBOSE);
+
+    if(ptrs == NULL || n == 0)
+        return;
+
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+
+    size_t i = 0;
+
+    /* NULL entries sort to the front */
+    while(i < n && ptrs[i] == NULL)
+        i++;
+
+    while(i < n)
+    {
+        char *ptr = ptrs[i];
+        trace_event('f', 0, ptr);
+
+        /* Huge blocks live in their own mmap regions */
+        size_t mlen = mmap_release(ptr);
+        if(mlen != 0)
+        {
+            stats.s.frees++;
+            stats.s.bytes_live -= mlen;
+            i++;
+            continue;
+        }
+
+        REQUIRES(in_heap(ptr));
+
+        /* Slab objects cannot merge; return them one at a time */
+        run_t *srun = run_of(ptr);
+        if(srun != NULL)
+        {
+            stats.s.frees++;
+            stats.s.bytes_live -= srun->size;
+            slab_free(ptr, srun);
+            i++;
+            continue;
+        }
+
+        harden_check(ptr);
+
+        /* Look up the arena owning this run */
+        arena_t *a = arena_for(ptr);
+        ASSERT(a != NULL);
+
+        pthread_mutex_lock(&a->lock);
+
+        /* Absorb the batch members sitting directly behind ptr */
+        size_t size = geth_size(ptr);
+        stats.s.frees++;
+        stats.s.bytes_live -= size;
+        i++;
+        while(i < n && (char*)ptrs[i] == ptr + size && arena_for(ptrs[i]) == a)
+        {
+            harden_check(ptrs[i]);
+            size_t next = geth_size(ptrs[i]);
+            trace_event('f', 0, ptrs[i]);
+            stats.s.frees++;
+            stats.s.bytes_live -= next;
+            size += next;
+            i++;
+        }
+
+        /* Free the whole run as a single block */
+        uint32_t pr = get_palloc(hdrp(ptr));
+        setH(ptr, size, pr, FREE);
+        setF(ptr, size, pr, FREE);
+        set_palloc_blk(next_blkp(ptr), PFREE);
+
+        if(defer_coalesce)
+        {
+            /* Park the run uncoalesced; consolidation merges it later */
+            add_free_block(a, ptr);
+            if(++a->deferred >= DEFER_FLUSH)
+                consolidate(a);
+            pthread_mutex_unlock(&a->lock);
+            continue;
+        }
+
+        /* Check if the run is behind the wilderness */
+        bool flag = false;
+        char *old_w = a->wilderness;
+        if(get_palloc(hdrp(a->wilderness)) == PFREE &&
+                (void*)ptr == prev_blkp(a->wilderness))
+            flag = true;
+
+        void *bp = coalesce(a, ptr);
+
+        /* If the run is not in the wilderness, add it to the seg_list */
+        if(flag)
+        {
+            a->wilderness = bp;
+            scrub_retired_wilderness(a, old_w);
+            /* An oversized wilderness goes back to the OS */
+            if(trim_threshold != 0 && geth_size(bp) > trim_threshold)
+                trim_arena(a, trim_threshold);
+        }
+        else
+        {
+            add_free_block(a, bp);
+            set_palloc(hdrp(next_blkp(bp)), PFREE);
+        }
+        touch_block(bp);
+
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    checkheap(VERBOSE);
+}
+
+/*
+ * Copy kernel for realloc. Payloads never overlap, so mid-size
+ * copies go through unrolled 16-byte vector moves, and copies big
+ * enough to trash the last-level cache (see nt_threshold) switch
+ * to non-temporal stores. Payloads are only DSIZE-aligned, so
+ * loads stay unaligned and the NT path first walks the destination
+ * up to a 16-byte boundary.
+ */
+static void *blk_copy(void *dst, const void *src, size_t n)
+{
+#ifdef __SSE2__
+    if(n >= 64)
+    {
+        char *d = dst;
+        const char *s = src;
+
+        if(nt_threshold != 0 && n >= nt_threshold)
+        {
+            size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+            if(head != 0)
+            {
+                memcpy(d, s, head);
+                d += head; s += head; n -= head;
+            }
+            while(n >= 64)
+            {
+                __m128i w0 = _mm_loadu_si128((const __m128i*)(s));
+                __m128i w1 = _mm_loadu_si128((const __m128i*)(s + 16));
+                __m128i w2 = _mm_loadu_si128((const __m128i*)(s + 32));
+                __m128i w3 = _mm_loadu_si128((const __m128i*)(s + 48));
+                _mm_stream_si128((__m128i*)(d), w0);
+                _mm_stream_si128((__m128i*)(d + 16), w1);
+                _mm_stream_si128((__m128i*)(d + 32), w2);
+                _mm_stream_si128((__m128i*)(d + 48), w3);
+                d += 64; s += 64; n -= 64;
+            }
+            /* Order the streamed stores before the payload is used */
+            _mm_sfence();
+            memcpy(d, s, n);
+            return dst;
+        }
+
+        while(n >= 64)
+        {
+            __m128i w0 = _mm_loadu_si128((const __m128i*)(s));
+            __m128i w1 = _mm_loadu_si128((const __m128i*)(s + 16));
+            __m128i w2 = _mm_loadu_si128((const __m128i*)(s + 32));
+            __m128i w3 = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_storeu_si128((__m128i*)(d), w0);
+            _mm_storeu_si128((__m128i*)(d + 16), w1);
+            _mm_storeu_si128((__m128i*)(d + 32), w2);
+            _mm_storeu_si128((__m128i*)(d + 48), w3);
+            d += 64; s += 64; n -= 64;
+        }
+        memcpy(d, s, n);
+        return dst;
+    }
+#endif
+    return memcpy(dst, src, n);
 }
 
 /*
- * Realloc routine. 
+ * Realloc routine.
  *
  * Realloc returns a pointer to memory with the specificied size
  * which contains the data from the old pointer.
  */
 void *realloc(void *oldptr, size_t size) {
-    REQUIRES(in_heap(oldptr) || oldptr == NULL);
     size_t oldsize;
     void *newptr;
 
@@ -893,87 +2329,170 @@ void *realloc(void *oldptr, size_t size) {
     if(oldptr == NULL) {
         return malloc(size);
     }
-    
-    //void* p = next_blkp(oldptr);
-    //size_t old = get_size(hdrp(oldptr)) - DSIZE;
-    //size_t asize = DSIZE*((size + DSIZE - 1)/DSIZE);
-    //size_t asize = ((size+1)/DSIZE)*DSIZE + DSIZE;
-    //if(size <= DSIZE - 2)
-    //    asize += DSIZE;
-    //if(asize >= 65536)
-    //    asize += 2*DSIZE;
-    /* If realloc size is less than old size, then return the old
-       pointer. If possible, create a new free block with the
-       extra space */
+
+    stats.s.reallocs++;
+    trace_event('r', size, oldptr);
+
     /*
-    if(asize <= old) 
+     * mmap-served blocks: still-huge requests that fit shrink in
+     * place; everything else moves by copy, so blocks dropping
+     * below the threshold return to the heap (and free their slot).
+     */
+    size_t mlen = mmap_length(oldptr);
+    if(mlen != 0)
     {
-        *//* Not enough space for another free block *//*
-        if(old - asize <= MINSIZE)
-            return oldptr;
-        else
-        {
-            *//* Alloc new size *//*
-            set(hdrp(oldptr), pack(asize + DSIZE, 1));
-            set(ftrp(oldptr), pack(asize + DSIZE, 1));
-            void* bp = next_blkp(oldptr);
-
-            *//* Create new free block *//*
-            set(hdrp(bp), pack(old - asize, 0));
-            set(ftrp(bp), pack(old - asize, 0));
-            add_free_block(bp);
+        size_t hsize = ((size+1)/DSIZE)*DSIZE + DSIZE;
+        if(hsize >= MMAP_THRESHOLD && size <= mlen)
             return oldptr;
-        }
-    }
-    */
-    /* Check if the next block is free, and if there is
-       enough space to realloc into the next block *//*
-    void* hd = hdrp(p);
-    if(!get_alloc(hd) && asize - old <= get_size(hd) && 
-       (get_size(hd) - (asize-old) >= MINSIZE))
-    {
-        *//* Make sure we don't remove the wilderness *//*
-        if(p != wilderness)
-            remove_free_block(p);
-        
-        *//* Get normalized size *//*
-        asize = DSIZE*(((size - old) + DSIZE - 1)/DSIZE); 
-        
-        *//* Place the block *//*
-        place(p, asize);
-        set(hdrp(oldptr), pack(old + asize + DSIZE, 1));
-        set(ftrp(oldptr), pack(old + asize + DSIZE, 1));
-        newptr = oldptr;
+        newptr = malloc(size);
+        if(!newptr)
+            return 0;
+        blk_copy(newptr, oldptr, size < mlen ? size : mlen);
+        free(oldptr);
+        return newptr;
     }
-    else
+
+    REQUIRES(in_heap(oldptr));
+
+    /* Slab objects: the run's class bounds the old payload */
+    run_t *run = run_of(oldptr);
+    if(run != NULL)
     {
-        */
-        /* Otherwise, we need to find somewhere else to realloc */
+        if(size <= run->size)
+            return oldptr;
         newptr = malloc(size);
-        
-        /* If realloc() fails the original block is left untouched  */
         if(!newptr)
             return 0;
+        memcpy(newptr, oldptr, run->size);
+        free(oldptr);
+        return newptr;
+    }
+
+    harden_check(oldptr);
+
+    /* Adjust block size the same way malloc does */
+    size_t asize = ((size+1)/DSIZE)*DSIZE + DSIZE;
+    if(asize < MINWSIZE)
+        asize = MINWSIZE;
+
+    /*
+     * In-place paths. Requests crossing MMAP_THRESHOLD move to an
+     * mmap region through the copy path below.
+     */
+    if(asize < MMAP_THRESHOLD)
+    {
+        size_t old = geth_size(oldptr);
+        arena_t *a = arena_for(oldptr);
+        ASSERT(a != NULL);
+        pthread_mutex_lock(&a->lock);
+
+        if(asize <= old)
+        {
+            /* Shrink: carve the tail into a free block if it fits */
+            if(old - asize >= MINWSIZE)
+            {
+                stats.s.bytes_live -= old - asize;
+                setH(oldptr, asize, get_palloc(hdrp(oldptr)), ALLOC);
+                void *bp = next_blkp(oldptr);
+                setH(bp, old-asize, PALLOC, FREE);
+                setF(bp, old-asize, PALLOC, FREE);
+                set_palloc_blk(next_blkp(bp), PFREE);
+
+                /* Return the tail exactly the way free() would */
+                bool flag = false;
+                char *old_w = a->wilderness;
+                if(get_palloc(hdrp(a->wilderness)) == PFREE &&
+                   bp == prev_blkp(a->wilderness))
+                    flag = true;
+                bp = coalesce(a, bp);
+                if(flag)
+                {
+                    a->wilderness = bp;
+                    scrub_retired_wilderness(a, old_w);
+                }
+                else
+                {
+                    add_free_block(a, bp);
+                    set_palloc_blk(next_blkp(bp), PFREE);
+                }
+            }
+            touch_block(oldptr);
+            pthread_mutex_unlock(&a->lock);
+            checkheap(VERBOSE);
+            return oldptr;
+        }
+
+        size_t need = asize - old;
+        void *next = next_blkp(oldptr);
 
-        /* Copy the old data. */
-        if(get_large(hdrp(oldptr)))
+        if(next == a->wilderness)
         {
-            oldsize = geth_size((char*)(oldptr) - DSIZE) - 18;
-            if(size < oldsize) 
-                oldsize = size;
-            memcpy(newptr, oldptr, oldsize);
+            /* Grow by pushing the wilderness boundary forward */
+            size_t wsize = geth_size(next);
+            if(wsize >= need + MINWSIZE)
+            {
+                stats.s.bytes_live += need;
+                setH(oldptr, asize, get_palloc(hdrp(oldptr)), ALLOC);
+                char *nw = next_blkp(oldptr);
+                setH(nw, wsize - need, PALLOC, FREE);
+                setF(nw, wsize - need, PALLOC, FREE);
+                a->wilderness = nw;
+                /* The grown payload may reach past the clean mark */
+                if(a->clean != NULL && nw > a->clean)
+                    a->clean = nw;
+                touch_block(oldptr);
+                pthread_mutex_unlock(&a->lock);
+                checkheap(VERBOSE);
+                return oldptr;
+            }
         }
-        else
+        else if(!get_alloc(hdrp(next)) && geth_size(next) >= need)
         {
-            oldsize = geth_size(oldptr)-2;
-            if(size < oldsize) 
-                oldsize = size;
-            memcpy(newptr, oldptr, oldsize);
+            /* Grow by absorbing the free successor */
+            remove_free_block(a, next);
+            size_t total = old + geth_size(next);
+            uint32_t pr = get_palloc(hdrp(oldptr));
+            if(total - asize >= MINWSIZE)
+            {
+                stats.s.bytes_live += asize - old;
+                setH(oldptr, asize, pr, ALLOC);
+                void *bp = next_blkp(oldptr);
+                setH(bp, total-asize, PALLOC, FREE);
+                setF(bp, total-asize, PALLOC, FREE);
+                set_palloc_blk(next_blkp(bp), PFREE);
+                add_free_block(a, bp);
+            }
+            else
+            {
+                stats.s.bytes_live += total - old;
+                setH(oldptr, total, pr, ALLOC);
+                setF(oldptr, total, pr, ALLOC);
+                set_palloc_blk(next_blkp(oldptr), PALLOC);
+            }
+            touch_block(oldptr);
+            pthread_mutex_unlock(&a->lock);
+            checkheap(VERBOSE);
+            return oldptr;
         }
 
-        /* Free the old block. */
-        free(oldptr);
-    //}
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    /* Otherwise, we need to find somewhere else to realloc */
+    newptr = malloc(size);
+
+    /* If realloc() fails the original block is left untouched  */
+    if(!newptr)
+        return 0;
+
+    /* Copy the old data. */
+    oldsize = geth_size(oldptr)-2;
+    if(size < oldsize)
+        oldsize = size;
+    blk_copy(newptr, oldptr, oldsize);
+
+    /* Free the old block. */
+    free(oldptr);
     checkheap(VERBOSE);
     return newptr;
 }
@@ -990,6 +2509,12 @@ void *calloc (size_t nmemb, size_t size) {
 
     /* Get memory from malloc */
     newptr = malloc(bytes);
+    if(newptr == NULL)
+        return NULL;
+
+    /* Skip the memset when malloc handed back provably-zero memory */
+    if(alloc_was_clean)
+        return newptr;
 
     /* Init memory */
     memset(newptr, 0, bytes);
@@ -997,133 +2522,573 @@ void *calloc (size_t nmemb, size_t size) {
     return newptr;
 }
 
-void print_checkheap() {
-    void *bp;
-    printf("Prologue %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d\n", heap_start, 
-        geth_size(heap_start), get_alloc(hdrp(heap_start)), 
-        get_palloc(hdrp(heap_start)), get_large(hdrp(heap_start)));
-    for (bp = heap_start+WSIZE; geth_size(bp) !=0; bp = next_blkp(bp))
-    {
-        if(get_alloc(hdrp(bp)))
-            printf("Checking %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d.\n",
-                bp, geth_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)), 
-                get_large(hdrp(bp)));
+/*
+ * memalign routine
+ *
+ * Returns a block whose payload is aligned to the given power of
+ * two. The block is found by over-allocating and carving: the
+ * misaligned front and any tail excess go back to the seg lists,
+ * so the result is an ordinary block that free and realloc handle
+ * like any other.
+ */
+void *memalign (size_t alignment, size_t size) {
+    /* Alignment must be a power of two */
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+
+    /* Every payload is DSIZE-aligned already */
+    if(alignment <= DSIZE)
+        return malloc(size);
+
+    if (size == 0)
+        return NULL;
+
+    size_t asize = ((size+1)/DSIZE)*DSIZE + DSIZE;
+    if(asize < MINWSIZE)
+        asize = MINWSIZE;
+
+    /* Huge requests (including the carving slack - the heap path
+       below must never land in an mmap region): mmap is page-aligned
+       for free; above that, over-map and trim the misaligned edges */
+    if(asize + alignment + MINWSIZE >= MMAP_THRESHOLD)
+    {
+        size_t pg = mem_pagesize();
+        if(alignment <= pg)
+            return mmap_alloc(size);
+
+        char *base = mmap_alloc(size + alignment);
+        if(base == NULL)
+            return NULL;
+        char *p = (char*)(((uintptr_t)base + alignment - 1) &
+                          ~((uintptr_t)alignment - 1));
+        if(p != base)
+        {
+            /* Shift the table entry onto the aligned tail */
+            pthread_mutex_lock(&mmap_lock);
+            for(int i = 0; i < mmap_cap; i++)
+            {
+                if(mmap_tab[i].addr == base)
+                {
+                    munmap(base, p - base);
+                    mmap_tab[i].addr = p;
+                    mmap_tab[i].len -= p - base;
+                    stats.s.bytes_live -= p - base;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&mmap_lock);
+        }
+        return p;
+    }
+
+    /* Over-allocate so an aligned payload always fits. The carving
+       below needs boundary tags, so never accept a slab object */
+    size_t need = size + alignment + MINWSIZE;
+    if(need <= SLABMAX)
+        need = SLABMAX + 1;
+    char *bp = malloc(need);
+    if(bp == NULL)
+        return NULL;
+
+    char *p = (char*)(((uintptr_t)bp + alignment - 1) &
+                      ~((uintptr_t)alignment - 1));
+    /* A front remainder must be a whole free block */
+    if(p != bp && (size_t)(p - bp) < MINWSIZE)
+        p += alignment;
+
+    arena_t *a = arena_for(bp);
+    ASSERT(a != NULL);
+    pthread_mutex_lock(&a->lock);
+
+    size_t csize = geth_size(bp);
+    uint32_t pr = get_palloc(hdrp(bp));
+
+    if(p != bp)
+    {
+        /* Return the misaligned front to the free lists */
+        size_t front = p - bp;
+        if(!internal_call)
+            stats.s.bytes_live -= front;
+        setH(bp, front, pr, FREE);
+        setF(bp, front, pr, FREE);
+        setH(p, csize - front, PFREE, ALLOC);
+        csize -= front;
+        void *fr = coalesce(a, bp);
+        add_free_block(a, fr);
+    }
+
+    /* Shed any tail excess, exactly the way a realloc shrink does */
+    if(csize - asize >= MINWSIZE)
+    {
+        if(!internal_call)
+            stats.s.bytes_live -= csize - asize;
+        setH(p, asize, get_palloc(hdrp(p)), ALLOC);
+        char *tail = (char*)next_blkp(p);
+        setH(tail, csize - asize, PALLOC, FREE);
+        setF(tail, csize - asize, PALLOC, FREE);
+        set_palloc_blk(next_blkp(tail), PFREE);
+
+        bool flag = false;
+        char *old_w = a->wilderness;
+        if(get_palloc(hdrp(a->wilderness)) == PFREE &&
+           tail == (char*)prev_blkp(a->wilderness))
+            flag = true;
+        tail = coalesce(a, tail);
+        if(flag)
+        {
+            a->wilderness = tail;
+            scrub_retired_wilderness(a, old_w);
+        }
         else
-            printf("Checking %p: HD %d, FT %d, ALLOC %d,%d PALLOC %d,%d LARGE %d,%d\n\t HEADER: %p FOOTER: %p\n",
-                bp, geth_size(bp), getf_size(bp), get_alloc(hdrp(bp)), 
-                get_alloc(ftrp(bp)), get_palloc(hdrp(bp)), 
-                get_palloc(ftrp(bp)), get_large(hdrp(bp)), 
-                get_large(ftrp(bp)), hdrp(bp), ftrp(bp));
-    } 
-    printf("Epilogue %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d\n", heap_end, 
-        geth_size(heap_end), get_alloc(hdrp(heap_end)), 
-        get_palloc(hdrp(heap_end)), get_large(hdrp(heap_end))); 
-    printf("Wilderness %p\n", wilderness);
+        {
+            add_free_block(a, tail);
+            set_palloc_blk(next_blkp(tail), PFREE);
+        }
+    }
+
+    /* Carving may have merged away the block malloc recorded */
+    touch_block(p);
+
+    pthread_mutex_unlock(&a->lock);
+    checkheap(VERBOSE);
+
+    ASSERT(((uintptr_t)p & (alignment - 1)) == 0);
+    return p;
 }
 
 /*
- * mm_checkheap:
- * Returns 0 if no errors were found, otherwise returns the error
+ * C11-style alias: aligned_alloc(alignment, size)
  */
-int mm_checkheap(int verbose) {
+void *aligned_alloc (size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/* Tallies one treap bin for mm_heap_profile */
+static void profile_tree(uint32_t off, size_t *count, size_t *bytes,
+                         size_t *largest)
+{
+    if(off == 0)
+        return;
+    void *bp = get_address(off);
+    size_t size = geth_size(bp);
+    *count += 1;
+    *bytes += size;
+    if(size > *largest)
+        *largest = size;
+    profile_tree(get_prev(bp), count, bytes, largest);
+    profile_tree(get_next(bp), count, bytes, largest);
+}
+
+/*
+ * Fills out with a snapshot of the heap's shape: per-bin free
+ * counts and byte totals straight from the seg_lists, the widest
+ * free run, the wilderness reserve, and a block-by-block walk of
+ * every segment for the allocated side - the programmatic
+ * counterpart of print_checkheap. Each arena's lock is held only
+ * while its own lists and segments are read, so the snapshot can
+ * be slightly torn across arenas; like the stats counters, this is
+ * for observability, not accounting.
+ */
+void mm_heap_profile(mm_profile_t *out)
+{
+    mm_stats_t snap;
+
+    ASSERT(MM_PROFILE_BINS == SEGSIZE);
+    memset(out, 0, sizeof(*out));
+
+    for(int i = 0; i < NARENAS; i++)
+    {
+        arena_t *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        for(int j = 0; j < SEGSIZE; j++)
+        {
+            size_t count = 0, bytes = 0;
+            if(j >= TREEBIN)
+            {
+                profile_tree(a->seg_list[j], &count, &bytes,
+                             &out->largest_free);
+            }
+            else
+            {
+                for(uint32_t p = a->seg_list[j]; p != 0;
+                        p = get_prev(get_address(p)))
+                {
+                    size_t size = geth_size(get_address(p));
+                    count++;
+                    bytes += size;
+                    if(size > out->largest_free)
+                        out->largest_free = size;
+                }
+            }
+            out->free_count[j] += count;
+            out->free_bytes[j] += bytes;
+            out->free_blocks += count;
+            out->free_total += bytes;
+        }
+        if(a->wilderness != NULL)
+        {
+            size_t size = geth_size(a->wilderness);
+            out->wilderness += size;
+            if(size > out->largest_free)
+                out->largest_free = size;
+        }
+
+        /* The allocated side comes from walking the arena's segments */
+        for(int s = 0; s < seg_count; s++)
+        {
+            if(seg_map[s].owner != a)
+                continue;
+            for(char *bp = seg_map[s].lo + 2*WSIZE; geth_size(bp) != 0;
+                    bp = next_blkp(bp))
+            {
+                if(get_alloc(hdrp(bp)))
+                {
+                    out->alloc_blocks++;
+                    out->alloc_bytes += geth_size(bp);
+                }
+            }
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    mm_get_stats(&snap);
+    out->heap_bytes = snap.heap_bytes;
+    out->live_bytes = snap.bytes_live;
+
+    if(out->free_total + out->wilderness > 0)
+        out->ext_frag = 1.0 - (double)out->largest_free /
+                              (double)(out->free_total + out->wilderness);
+    if(out->heap_bytes > 0)
+        out->overhead = 1.0 - (double)out->live_bytes /
+                              (double)out->heap_bytes;
+}
+
+void print_checkheap() {
     void *bp;
+    for(int s = 0; s < seg_count; s++)
+    {
+        char *start = seg_map[s].lo + WSIZE;
+        printf("Segment %d (arena %ld):\n", s,
+            (long)(seg_map[s].owner - arenas));
+        printf("Prologue %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d\n", start,
+            geth_size(start), get_alloc(hdrp(start)),
+            get_palloc(hdrp(start)), get_large(hdrp(start)));
+        for (bp = start+WSIZE; geth_size(bp) !=0; bp = next_blkp(bp))
+        {
+            if(get_alloc(hdrp(bp)))
+                printf("Checking %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d.\n",
+                    bp, geth_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)),
+                    get_large(hdrp(bp)));
+            else
+                printf("Checking %p: HD %d, FT %d, ALLOC %d,%d PALLOC %d,%d LARGE %d,%d\n\t HEADER: %p FOOTER: %p\n",
+                    bp, geth_size(bp), getf_size(bp), get_alloc(hdrp(bp)),
+                    get_alloc(ftrp(bp)), get_palloc(hdrp(bp)),
+                    get_palloc(ftrp(bp)), get_large(hdrp(bp)),
+                    get_large(ftrp(bp)), hdrp(bp), ftrp(bp));
+        }
+        printf("Epilogue %p: HD %d\tALLOC %d, PALLOC %d, LARGE %d\n", bp,
+            geth_size(bp), get_alloc(hdrp(bp)),
+            get_palloc(hdrp(bp)), get_large(hdrp(bp)));
+        printf("Wilderness %p\n", seg_map[s].owner->wilderness);
+    }
+}
+
+/*
+ * Validates one treap bin recursively; returns the number of blocks.
+ */
+static uint32_t check_tree_bin(uint32_t root, int verbose, int i)
+{
+    if(root == 0)
+        return 0;
+    void *bp = get_address(root);
 
     if(verbose)
-        printf("Entering Checkheap.\n");
+        printf("Checking pointer in treap bin %d: %p. Size: %x\n",
+            i, bp, get_size(hdrp(bp)));
+
+    /* Check block consistency of the treap free block */
+    passert(in_heap(bp));
+    passert(aligned(bp));
+    passert(geth_size(bp) >= MINWSIZE);
+    passert(get_alloc(hdrp(bp)) == 0);
+    passert(geth_size(bp) == getf_size(bp));
+    passert(get_alloc(ftrp(bp)) == 0);
+
+    /* Check search-tree order and heap priority order */
+    uint32_t l = get_prev(bp);
+    uint32_t r = get_next(bp);
+    if(l != 0)
+    {
+        passert(tree_less(l, root));
+        passert(tree_prio(l) >= tree_prio(root));
+    }
+    if(r != 0)
+    {
+        passert(!tree_less(r, root));
+        passert(tree_prio(r) >= tree_prio(root));
+    }
+
+    return 1 + check_tree_bin(l, verbose, i) + check_tree_bin(r, verbose, i);
+}
+
+/*
+ * Incremental check: validates only the block this thread last
+ * created or freed - its tags, its coalesce neighborhood, and its
+ * bin membership - instead of sweeping the whole heap.
+ */
+static int check_touched(int verbose)
+{
+    void *bp = last_touched;
+    if(bp == NULL || touched_gen != heap_gen)
+        return 0;
 
     if(verbose)
-        printf("Checking Prologue.\n");
-
-    /* Check Prologue */
-
-    passert(geth_size(heap_start) == 0);
-    passert(get_alloc(hdrp(heap_start)) == ALLOC);
-    bool is_free = false;
-    uint32_t free_block_count = 0;
-    uint32_t is_alloc = get_alloc(hdrp(heap_start));
-    for (bp = heap_start+WSIZE; geth_size(bp) !=0; bp = next_blkp(bp))
-    {
-        if(verbose && get_alloc(hdrp(bp)))
-            printf("Checking %p: HD %d, ALLOC %d, PALLOC %d.\n", 
-             bp, geth_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)));
-        else if(verbose && !get_alloc(hdrp(bp)))
-            printf("Checking %p: HD %d, FT %d, ALLOC %d, PALLOC %d.\n", 
-             bp, geth_size(bp), getf_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)));
-        
-        /* Check heap block consistency */
-        passert(in_heap(bp));
-        passert(aligned(bp));
-        passert(geth_size(bp) >= MINSIZE);
-        if(get_alloc(hdrp(bp)) == 0)
+        printf("Incremental check of %p.\n", bp);
+
+    passert(in_heap(bp));
+    passert(aligned(bp));
+
+    size_t size = geth_size(bp);
+    passert(size >= MINSIZE);
+
+    arena_t *a = arena_for(bp);
+    passert(a != NULL);
+
+    int is_free = !get_alloc(hdrp(bp));
+    if(is_free)
+    {
+        passert(geth_size(bp) == getf_size(bp));
+        passert(get_alloc(ftrp(bp)) == 0);
+        passert(get_palloc(hdrp(bp)) == get_palloc(ftrp(bp)));
+    }
+
+    /* The successor must mirror this block's alloc bit, and two
+       adjacent free blocks only exist under deferred coalescing */
+    void *next = next_blkp(bp);
+    if(in_heap(next))
+    {
+        passert(get_palloc(hdrp(next)) == (is_free ? PFREE : PALLOC));
+        if(geth_size(next) != 0)
         {
-            passert(geth_size(bp) == getf_size(bp));
-            passert(get_alloc(hdrp(bp)) == get_alloc(ftrp(bp)));
-            passert(get_palloc(hdrp(bp)) == get_palloc(ftrp(bp)));
-            passert(get_large(hdrp(bp)) == get_large(ftrp(bp)));
+            passert(aligned(next));
+            if(!defer_coalesce && is_free && (char*)bp != a->wilderness)
+            {
+                passert(get_alloc(hdrp(next)) ||
+                        (char*)next == a->wilderness);
+            }
         }
-        passert(geth_size(bp) == (char*)ftrp(bp)-(char*)hdrp(bp) + HSIZE);
-        passert(get_palloc(hdrp(bp))/PALLOC == is_alloc);
-        is_alloc = get_alloc(hdrp(bp));
-        if(get_alloc(hdrp(bp)) == 0)
+    }
+
+    /* A free predecessor is reachable through its footer */
+    if(get_palloc(hdrp(bp)) == PFREE)
+    {
+        void *prev = prev_blkp(bp);
+        passert(in_heap(prev));
+        passert(get_alloc(hdrp(prev)) == 0);
+        passert(geth_size(prev) == getf_size(prev));
+        if(!defer_coalesce)
         {
-            /* No consecutive free blocks */
             passert(!is_free);
-            is_free = true;
-            free_block_count++;
+        }
+    }
+
+    /* A binned free block must be reachable from its bin */
+    if(is_free && (char*)bp != a->wilderness)
+    {
+        size_t index = get_index(size);
+        passert(a->seg_mask & (1u << index));
+
+        uint32_t off = get_offset(bp);
+        uint32_t p = a->seg_list[index];
+        bool found = false;
+        if(index >= TREEBIN)
+        {
+            while(p != 0)
+            {
+                if(p == off)
+                {
+                    found = true;
+                    break;
+                }
+                p = tree_less(off, p) ? get_prev(get_address(p))
+                                      : get_next(get_address(p));
+            }
         }
         else
         {
-            is_free = false;
+            while(p != 0)
+            {
+                if(p == off)
+                {
+                    found = true;
+                    break;
+                }
+                p = get_prev(get_address(p));
+            }
         }
+        passert(found);
     }
 
-    /* Epilogue */
+    return 0;
+}
 
-    /* heap_end is one more then allocated heap max */
-    REQUIRES(bp == ((char*)mem_heap_hi() + 1));
-    passert(bp == heap_end);
-    
-    /* Check epilogue block conditions */
-    passert(geth_size(bp) == 0);
-    passert(get_alloc(hdrp(bp)) == 1);
+/*
+ * mm_checkheap:
+ * Returns 0 if no errors were found, otherwise returns the error
+ *
+ * Each arena's lock is held while its own segments, lists and runs
+ * are swept, like mm_heap_profile; every checkheap macro site sits
+ * outside the caller's arena lock, so this cannot self-deadlock.
+ */
+int mm_checkheap(int verbose) {
+    void *bp;
+
+    /* Sampled mode: between full sweeps, validate only what the
+       current thread just touched */
+    if(check_interval > 1 && ++check_calls % check_interval != 0)
+        return check_touched(verbose);
 
-    /* Make sure the previous block is the wilderness */
-    passert(prev_blkp(bp) == wilderness);
-    
     if(verbose)
-        printf("Checking seglists.\n");
-    
-    uint32_t seg_list_count = 0;
-    for(int i = 0; i < SEGSIZE; i++)
+        printf("Entering Checkheap.\n");
+
+    for(int ai = 0; ai < NARENAS; ai++)
     {
-        uint32_t p = seg_list[i];
-        while(p != 0)
+        arena_t *a = &arenas[ai];
+        if(!a->ready)
+            continue;
+        pthread_mutex_lock(&a->lock);
+
+        uint32_t free_block_count = 0;
+
+        /* Walk every segment owned by this arena */
+        for(int s = 0; s < seg_count; s++)
         {
-            seg_list_count++;
-            void* bp = get_address(p);
+            if(seg_map[s].owner != a)
+                continue;
+
+            char *start = seg_map[s].lo + WSIZE;
 
             if(verbose)
-                printf("Checking pointer in seglist %d: %p. Size: %x\n",i,bp,get_size(hdrp(bp)));
-            
-            /* Check block consistency of seg_list free block */
-            passert(in_heap(bp));
-            passert(aligned(bp));
-            passert(geth_size(bp) >= MINSIZE);
-            if(get_alloc(hdrp(bp)) == 0)
+                printf("Checking Prologue of segment %d.\n", s);
+
+            /* Check Prologue */
+
+            passert(geth_size(start) == 0);
+            passert(get_alloc(hdrp(start)) == ALLOC);
+            bool is_free = false;
+            uint32_t is_alloc = get_alloc(hdrp(start));
+            for (bp = start+WSIZE; geth_size(bp) !=0; bp = next_blkp(bp))
             {
-                passert(geth_size(bp) == getf_size(bp));
-                passert(get_alloc(ftrp(bp)) == 0);
+                if(verbose && get_alloc(hdrp(bp)))
+                    printf("Checking %p: HD %d, ALLOC %d, PALLOC %d.\n",
+                     bp, geth_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)));
+                else if(verbose && !get_alloc(hdrp(bp)))
+                    printf("Checking %p: HD %d, FT %d, ALLOC %d, PALLOC %d.\n",
+                     bp, geth_size(bp), getf_size(bp), get_alloc(hdrp(bp)), get_palloc(hdrp(bp)));
+
+                /* Check heap block consistency */
+                passert(in_heap(bp));
+                passert(aligned(bp));
+                passert(geth_size(bp) >= MINSIZE);
+                if(get_alloc(hdrp(bp)) == 0)
+                {
+                    passert(geth_size(bp) == getf_size(bp));
+                    passert(get_alloc(hdrp(bp)) == get_alloc(ftrp(bp)));
+                    passert(get_palloc(hdrp(bp)) == get_palloc(ftrp(bp)));
+                    passert(get_large(hdrp(bp)) == get_large(ftrp(bp)));
+                }
+                passert(geth_size(bp) == (char*)ftrp(bp)-(char*)hdrp(bp) + HSIZE);
+                passert(get_palloc(hdrp(bp))/PALLOC == is_alloc);
+                is_alloc = get_alloc(hdrp(bp));
+                if(get_alloc(hdrp(bp)) == 0)
+                {
+                    /* No consecutive free blocks (unless deferred) */
+                    if(!defer_coalesce)
+                    {
+                        passert(!is_free);
+                    }
+                    is_free = true;
+                    free_block_count++;
+                }
+                else
+                {
+                    is_free = false;
+                }
+            }
+
+            /* Epilogue */
+
+            /* Every segment ends exactly at its mapped boundary */
+            passert((char*)bp == seg_map[s].hi);
+
+            /* Check epilogue block conditions */
+            passert(geth_size(bp) == 0);
+            passert(get_alloc(hdrp(bp)) == 1);
+
+            /* The growing segment ends with the wilderness */
+            if(s == a->seg_idx)
+            {
+                passert(bp == a->heap_end);
+                passert(prev_blkp(bp) == a->wilderness);
+
+                /* The clean frontier must be in-segment and all zero,
+                   minus the top tags and the wide wilderness header */
+                if(a->clean != NULL)
+                {
+                    passert(a->clean >= seg_map[s].lo);
+                    passert(a->clean <= (char*)a->heap_end);
+                    char *q = a->clean;
+                    if(q < (char*)a->wilderness + DSIZE)
+                        q = (char*)a->wilderness + DSIZE;
+                    for(; q < (char*)a->heap_end - 2*WSIZE - HSIZE; q++)
+                    {
+                        passert(*q == 0);
+                    }
+                }
+            }
+        }
+
+        if(verbose)
+            printf("Checking seglists of arena %d.\n", ai);
+
+        uint32_t seg_list_count = 0;
+        for(int i = 0; i < SEGSIZE; i++)
+        {
+            /* The occupancy mask must agree with the list heads */
+            passert(((a->seg_mask >> i) & 1) == (a->seg_list[i] != 0));
+
+            if(i >= TREEBIN)
+            {
+                seg_list_count += check_tree_bin(a->seg_list[i], verbose, i);
+                continue;
             }
-            passert(get_alloc(hdrp(bp)) == 0);
-            //passert(get_size(hdrp(bp))==(char*)ftrp(bp)-(char*)hdrp(bp)+WSIZE);
-            
-            uint32_t np = get_prev(bp);
 
-            if(i != 0)
+            uint32_t p = a->seg_list[i];
+            while(p != 0)
             {
+                seg_list_count++;
+                void* bp = get_address(p);
+
+                if(verbose)
+                    printf("Checking pointer in seglist %d: %p. Size: %x\n",i,bp,get_size(hdrp(bp)));
+
+                /* Check block consistency of seg_list free block */
+                passert(in_heap(bp));
+                passert(aligned(bp));
+                passert(geth_size(bp) >= MINWSIZE);
+                if(get_alloc(hdrp(bp)) == 0)
+                {
+                    passert(geth_size(bp) == getf_size(bp));
+                    passert(get_alloc(ftrp(bp)) == 0);
+                }
+                passert(get_alloc(hdrp(bp)) == 0);
+                //passert(get_size(hdrp(bp))==(char*)ftrp(bp)-(char*)hdrp(bp)+WSIZE);
+
+                uint32_t np = get_prev(bp);
+
                 /* Check link structure */
                 uint32_t nl = get_next(bp);
-                
+
                 if(np != 0)
                 {
                     passert(get_next(get_address(np)) == p);
@@ -1132,15 +3097,47 @@ int mm_checkheap(int verbose) {
                 {
                     passert(get_prev(get_address(nl)) == p);
                 }
+                p = np;
             }
-            p = np;
         }
-    }
 
-    /* Check if the seglist has all the possible free blocks
-       Remember that the wilderness block is free, but doesn't count
-       as a seg_list block, there it is included in the free count,
-       but not in the seg count */
-    passert(free_block_count == seg_list_count + 1);
+        /* Check if the seglist has all the possible free blocks
+           Remember that the wilderness block is free, but doesn't count
+           as a seg_list block, there it is included in the free count,
+           but not in the seg count */
+        passert(free_block_count == seg_list_count + 1);
+
+        /* Check the slab runs on the partial lists */
+        for(int c = 0; c < SLABCLASSES; c++)
+        {
+            uint32_t r = a->run_head[c];
+            while(r != 0)
+            {
+                run_t *run = (run_t*)get_address(r);
+
+                if(verbose)
+                    printf("Checking run in class %d: %p. Inuse: %u\n",
+                        c, (void*)run, run->inuse);
+
+                passert(((uintptr_t)run & (RUNSIZE - 1)) == 0);
+                passert(run->size == (uint16_t)((c + 1)*DSIZE));
+                passert(run->inuse > 0 && run->inuse < run->cap);
+
+                /* The bitmap must agree with the inuse count */
+                uint32_t used = 0;
+                for(int w = 0; w < DSIZE; w++)
+                    used += __builtin_popcountll(run->map[w]);
+                passert(used == run->inuse + 8*sizeof(run->map) - run->cap);
+
+                /* The page must be registered for free() lookups */
+                size_t idx = (size_t)((char*)run - (char*)mem_heap_lo())
+                             / RUNSIZE;
+                passert(run_map[idx >> 3] & (1u << (idx & 7)));
+
+                r = run->next;
+            }
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
     return 0;
 }
\ No newline at end of file
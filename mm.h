@@ -7,6 +7,8 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign (size_t alignment, size_t size);
+extern void *mm_aligned_alloc (size_t alignment, size_t size);
 
 #else
 
@@ -15,11 +17,96 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign (size_t alignment, size_t size);
+extern void *aligned_alloc (size_t alignment, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Allocation statistics snapshot. Counters are updated with plain
+   stores on the hot paths, so concurrent updates may lose the odd
+   increment; they are meant for observability, not accounting. */
+typedef struct {
+    size_t mallocs; /* malloc calls (calloc/memalign included) */
+    size_t frees; /* blocks freed */
+    size_t reallocs; /* realloc calls */
+    size_t bytes_requested; /* cumulative bytes asked of malloc */
+    size_t bytes_live; /* block bytes currently allocated */
+    size_t heap_bytes; /* bytes held from the OS (sbrk + mmap) */
+} mm_stats_t;
+
+extern void mm_get_stats(mm_stats_t *out);
+
+/* One allocation-trace event. op is 'm' (malloc), 'f' (free) or
+   'r' (realloc); cycles comes from the cycle counter in clock.h. */
+typedef struct {
+    double cycles;
+    void *addr;
+    size_t size;
+    unsigned op;
+    unsigned seq; /* low bits of the global event sequence */
+} mm_event_t;
+
+/* Optional allocation tracing into a preallocated ring buffer of
+   the given capacity. Recording an event is lock-free and costs
+   tens of cycles, so tracing can stay enabled in canary builds.
+   mm_trace_dump stops nothing: call mm_trace_stop first, then dump
+   the ring (oldest event first) as binary mm_event_t records.
+   Returns the number of records written, or 0 on error. */
+extern int mm_trace_start(size_t capacity);
+extern void mm_trace_stop(void);
+extern size_t mm_trace_dump(const char *path);
+
+/* Free n blocks in one pass: the array is sorted in place by
+   address and physically adjacent blocks are merged before the
+   free lists are touched */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Toggle deferred coalescing (frees skip coalesce; a consolidation
+   pass merges adjacent free runs when allocation pressure demands) */
+extern void mm_set_defer_coalesce(int on);
+
+/* Bound the adaptive heap-extension size (doubles from min to max) */
+extern void mm_set_chunk_limits(size_t min, size_t max);
+
+/* Release excess wilderness pages to the OS, keeping pad bytes per
+   arena resident; returns the number of bytes released. A nonzero
+   threshold makes free() trim oversized wildernesses automatically. */
+extern size_t mm_trim(size_t pad);
+extern void mm_set_trim_threshold(size_t bytes);
+
+/* Heap topology snapshot, filled by mm_heap_profile. Byte figures
+   are block sizes, headers included; bins follow the allocator's
+   segregated-list classes, smallest first. Allocated counts include
+   blocks parked in thread caches. */
+#define MM_PROFILE_BINS 32
+
+typedef struct {
+    size_t free_count[MM_PROFILE_BINS]; /* free blocks per bin... */
+    size_t free_bytes[MM_PROFILE_BINS]; /* ...and their byte totals */
+    size_t free_blocks;   /* binned free blocks across all arenas */
+    size_t free_total;    /* bytes in those blocks */
+    size_t largest_free;  /* widest free run, wilderness included */
+    size_t wilderness;    /* bytes parked in arena wilderness blocks */
+    size_t alloc_blocks;  /* live heap blocks */
+    size_t alloc_bytes;   /* bytes in those blocks */
+    size_t heap_bytes;    /* bytes held from the OS (sbrk + mmap) */
+    size_t live_bytes;    /* block bytes currently allocated */
+    double ext_frag;      /* 1 - largest free run / total free bytes */
+    double overhead;      /* share of heap_bytes not serving live blocks */
+} mm_profile_t;
+
+/* Walk the heap and free lists into out. Cheap enough to poll from
+   a monitoring agent; takes each arena lock briefly, so concurrent
+   allocation stalls only per arena. */
+extern void mm_heap_profile(mm_profile_t *out);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern int mm_checkheap(int verbose);
+
+/* Sample mm_checkheap: run the full O(heap) sweep only every nth
+   call, validating just the blocks touched by the current
+   operation in between. n <= 1 restores a sweep on every call. */
+extern void mm_set_check_interval(unsigned n);
@@ -0,0 +1,378 @@
+/*
+ * mmrecord.c - LD_PRELOAD allocation recorder.
+ *
+ * mm.h already declares the interpositioning entry points; this shim
+ * is the other half of that story: preload it into a live process to
+ * capture its allocation calls as a trace the driver can replay.
+ * Every malloc/free/realloc/calloc is forwarded to the real libc
+ * allocator and appended to an in-memory op log; at process exit the
+ * log is written as a text .rep trace that read_trace() consumes, so
+ * yesterday's production incident can be replayed with mdriver -f
+ * and measured before and after an allocator change.
+ *
+ * Block addresses are mapped to dense indices the way the driver
+ * expects, with indices recycled on free to keep num_ids (and the
+ * driver's per-block arrays) small. memalign/aligned_alloc are
+ * recorded as plain allocations, since the trace format carries only
+ * sizes. Ops are buffered in mmap'd memory - never through the
+ * allocator being recorded - so recording overhead is one mutex and
+ * a few stores per call.
+ *
+ * Build:   gcc -O2 -shared -fPIC -o mmrecord.so mmrecord.c -ldl
+ * Record:  MM_RECORD_OUT=incident.rep LD_PRELOAD=./mmrecord.so ./service
+ * Replay:  mdriver -f incident.rep
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The real allocator, resolved lazily */
+static void *(*real_malloc)(size_t);
+static void  (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+/* glibc's dlsym allocates, so calloc calls made while we resolve the
+   real functions are served from this static arena. Blocks from it
+   are never freed and never recorded. */
+static char boot_arena[16384];
+static size_t boot_used;
+static int resolving;
+
+/* One recorded op: type is 'a', 'r' or 'f' */
+typedef struct {
+    char type;
+    int index;
+    size_t size;
+} record_t;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int recording = 1;        /* cleared while the trace is written */
+
+/* The op log, an mmap'd array doubled as it fills */
+static record_t *log_ops;
+static size_t log_len, log_cap;
+
+/* ptr -> index map: open addressing, power-of-two sized, with
+   tombstones so deleted slots keep probe chains intact */
+#define SLOT_EMPTY NULL
+#define SLOT_DEAD  ((void *)-1)
+typedef struct {
+    void *ptr;
+    int index;
+} slot_t;
+static slot_t *slots;
+static size_t nslots, nused;     /* nused counts live + dead slots */
+
+/* Recycled indices, a simple stack; next_index grows num_ids */
+static int *free_indices;
+static size_t nfree_indices, free_indices_cap;
+static int next_index;
+
+/*
+ * grow - mmap'd realloc for the recorder's own arrays, so the log
+ *    never allocates through the allocator it is recording.
+ */
+static void *grow(void *old, size_t old_bytes, size_t new_bytes)
+{
+    void *p = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (old != NULL) {
+        memcpy(p, old, old_bytes);
+        munmap(old, old_bytes);
+    }
+    return p;
+}
+
+static void resolve(void)
+{
+    resolving = 1;
+    real_malloc        = dlsym(RTLD_NEXT, "malloc");
+    real_free          = dlsym(RTLD_NEXT, "free");
+    real_realloc       = dlsym(RTLD_NEXT, "realloc");
+    real_calloc        = dlsym(RTLD_NEXT, "calloc");
+    real_memalign      = dlsym(RTLD_NEXT, "memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    resolving = 0;
+}
+
+static int from_boot_arena(const void *p)
+{
+    return (const char *)p >= boot_arena &&
+           (const char *)p < boot_arena + sizeof(boot_arena);
+}
+
+/* Map internals; callers hold record_lock */
+
+static size_t slot_hash(const void *p)
+{
+    return (((uintptr_t)p >> 4) * 2654435761UL) & (nslots - 1);
+}
+
+static void slot_insert(void *p, int index)
+{
+    size_t i = slot_hash(p);
+    while (slots[i].ptr != SLOT_EMPTY && slots[i].ptr != SLOT_DEAD)
+        i = (i + 1) & (nslots - 1);
+    if (slots[i].ptr == SLOT_EMPTY)
+        nused++;
+    slots[i].ptr = p;
+    slots[i].index = index;
+}
+
+static void grow_slots(void)
+{
+    slot_t *old = slots;
+    size_t old_n = nslots;
+    size_t i;
+
+    nslots = (old_n == 0) ? 4096 : old_n * 2;
+    slots = grow(NULL, 0, nslots * sizeof(slot_t));
+    if (slots == NULL)
+        _exit(73);
+    nused = 0;
+    for (i = 0; i < old_n; i++)
+        if (old[i].ptr != SLOT_EMPTY && old[i].ptr != SLOT_DEAD)
+            slot_insert(old[i].ptr, old[i].index);
+    if (old != NULL)
+        munmap(old, old_n * sizeof(slot_t));
+}
+
+static slot_t *slot_find(const void *p)
+{
+    size_t i;
+    if (nslots == 0)
+        return NULL;
+    i = slot_hash(p);
+    while (slots[i].ptr != SLOT_EMPTY) {
+        if (slots[i].ptr == (void *)p)
+            return &slots[i];
+        i = (i + 1) & (nslots - 1);
+    }
+    return NULL;
+}
+
+static int index_alloc(void)
+{
+    if (nfree_indices > 0)
+        return free_indices[--nfree_indices];
+    return next_index++;
+}
+
+static void index_release(int index)
+{
+    if (nfree_indices == free_indices_cap) {
+        size_t ncap = (free_indices_cap == 0) ? 1024 : free_indices_cap * 2;
+        free_indices = grow(free_indices,
+                            free_indices_cap * sizeof(int),
+                            ncap * sizeof(int));
+        if (free_indices == NULL)
+            _exit(73);
+        free_indices_cap = ncap;
+    }
+    free_indices[nfree_indices++] = index;
+}
+
+static void log_append(char type, int index, size_t size)
+{
+    if (log_len == log_cap) {
+        size_t ncap = (log_cap == 0) ? 65536 : log_cap * 2;
+        log_ops = grow(log_ops, log_cap * sizeof(record_t),
+                       ncap * sizeof(record_t));
+        if (log_ops == NULL)
+            _exit(73);
+        log_cap = ncap;
+    }
+    log_ops[log_len].type = type;
+    log_ops[log_len].index = index;
+    log_ops[log_len].size = size;
+    log_len++;
+}
+
+/*
+ * record_alloc/record_free - the common paths behind the hooks.
+ *    Pointers we never saw allocated (pre-preload, or handed out by
+ *    the bootstrap arena) are forwarded but not recorded.
+ */
+static void record_alloc(void *p, size_t size)
+{
+    int index;
+    if (p == NULL)
+        return;
+    pthread_mutex_lock(&record_lock);
+    if (recording) {
+        if (nslots == 0 || 2 * nused >= nslots)
+            grow_slots();
+        index = index_alloc();
+        slot_insert(p, index);
+        log_append('a', index, size);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+static void record_free(void *p)
+{
+    slot_t *s;
+    pthread_mutex_lock(&record_lock);
+    if (recording && (s = slot_find(p)) != NULL) {
+        log_append('f', s->index, 0);
+        index_release(s->index);
+        s->ptr = SLOT_DEAD;
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+static void record_realloc(void *oldp, void *newp, size_t size)
+{
+    slot_t *s;
+    int index;
+    if (newp == NULL)
+        return;
+    pthread_mutex_lock(&record_lock);
+    if (recording) {
+        if (nslots == 0 || 2 * nused >= nslots)
+            grow_slots();
+        if ((s = slot_find(oldp)) != NULL) {
+            index = s->index;
+            s->ptr = SLOT_DEAD;
+            slot_insert(newp, index);
+            log_append('r', index, size);
+        } else {
+            /* growing a block we never saw: record the birth */
+            index = index_alloc();
+            slot_insert(newp, index);
+            log_append('a', index, size);
+        }
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+/*
+ * dump_trace - write the op log in the text .rep format read_trace()
+ *    parses: weight, num_ids, num_ops, ignore_ranges, then one
+ *    a/r/f line per op. Runs as a destructor; recording is switched
+ *    off first so the writer's own allocations stay out of the log.
+ */
+__attribute__((destructor))
+static void dump_trace(void)
+{
+    const char *path = getenv("MM_RECORD_OUT");
+    char pathbuf[64];
+    FILE *out;
+    size_t i;
+
+    pthread_mutex_lock(&record_lock);
+    recording = 0;
+    pthread_mutex_unlock(&record_lock);
+
+    if (path == NULL) {
+        snprintf(pathbuf, sizeof(pathbuf), "mm-record.%d.rep",
+                 (int)getpid());
+        path = pathbuf;
+    }
+    if ((out = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "mmrecord: could not open %s\n", path);
+        return;
+    }
+
+    fprintf(out, "%d\n%d\n%zu\n%d\n", 0, next_index, log_len, 0);
+    for (i = 0; i < log_len; i++) {
+        if (log_ops[i].type == 'f')
+            fprintf(out, "f %d\n", log_ops[i].index);
+        else
+            fprintf(out, "%c %d %zu\n", log_ops[i].type,
+                    log_ops[i].index, log_ops[i].size);
+    }
+    fclose(out);
+    fprintf(stderr, "mmrecord: wrote %zu ops (%d ids) to %s\n",
+            log_len, next_index, path);
+}
+
+/* The interposed entry points */
+
+void *malloc(size_t size)
+{
+    void *p;
+    if (real_malloc == NULL)
+        resolve();
+    p = real_malloc(size);
+    record_alloc(p, size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || from_boot_arena(ptr))
+        return;
+    if (real_free == NULL)
+        resolve();
+    record_free(ptr);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    if (real_realloc == NULL)
+        resolve();
+    if (size == 0 && ptr != NULL) {
+        free(ptr);
+        return NULL;
+    }
+    p = real_realloc(ptr, size);
+    if (ptr == NULL)
+        record_alloc(p, size);
+    else
+        record_realloc(ptr, p, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+    if (real_calloc == NULL) {
+        if (resolving) {
+            /* dlsym bootstrapping itself */
+            size_t bytes = (nmemb * size + 15) & ~(size_t)15;
+            if (boot_used + bytes > sizeof(boot_arena))
+                return NULL;
+            p = boot_arena + boot_used;
+            boot_used += bytes;
+            return p;
+        }
+        resolve();
+    }
+    p = real_calloc(nmemb, size);
+    record_alloc(p, nmemb * size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p;
+    if (real_memalign == NULL)
+        resolve();
+    p = real_memalign(alignment, size);
+    record_alloc(p, size);
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *p;
+    if (real_aligned_alloc == NULL)
+        resolve();
+    p = real_aligned_alloc(alignment, size);
+    record_alloc(p, size);
+    return p;
+}